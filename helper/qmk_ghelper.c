@@ -1,5 +1,6 @@
 // https://github.com/rricharz/Raspberry-Pi-easy-drawing/blob/master/main.c
 
+#include <endian.h>
 #include <stdio.h>
 #include <string.h>
 #include <cairo.h>
@@ -9,6 +10,7 @@
 #include "qmk_gadget.h"
 #include "qmk_socket_listener.h"
 #include "qmk_socket.h"
+#include "qmk_keymap.h"
 
 #define WINDOW_WIDTH 800 // proposed width of main window
 #define WINDOW_HEIGHT 480 // proposed height of main window
@@ -27,9 +29,13 @@ static bool needs_update = true;
 static bool first_run = true;
 static uint8_t update_row, update_col;
 static uint8_t active_layer = 0;
-static uint16_t layer_state = 1;
+static uint32_t layer_state = 1;
 static bool usb_passthrough = false;
 
+/* keymap of the keyboard, from its KEYMAP_DUMP reply */
+static unsigned int keymap_layers;
+static uint16_t *keymap_codes;
+
 struct qmk_key {
 	bool pressed;
 	uint8_t width;
@@ -130,15 +136,50 @@ static gboolean on_draw_event(GtkWidget *widget, cairo_t *cr,
 	return FALSE;
 }
 
+/* keeps the keymap when it fits the drawn layout, the legends come from it */
+static void handle_dump(struct qmk_keymap_dump *dump)
+{
+	const uint16_t *codes = (const uint16_t *)(&dump->keymap + 1);
+	unsigned int layers = le16toh(dump->keymap.layers);
+	size_t i, count;
+
+	if (le32toh(dump->magic) != QMK_DUMP_MAGIC ||
+	    le16toh(dump->keymap.rows) != KEYBOARD_ROWS ||
+	    le16toh(dump->keymap.cols) != KEYBOARD_COLS)
+		return;
+
+	count = (size_t)layers * KEYBOARD_ROWS * KEYBOARD_COLS;
+	free(keymap_codes);
+	keymap_codes = malloc(count * sizeof(*keymap_codes));
+	if (!keymap_codes)
+		return;
+
+	for (i = 0; i < count; i++)
+		keymap_codes[i] = le16toh(codes[i]);
+	keymap_layers = layers;
+	layer_state = le32toh(dump->layer_state);
+	active_layer = dump->active_layer;
+
+	printf("\033[0;33mKeymap of profile %d, %d layers\033[0m\n",
+	       le16toh(dump->keymap.profile), keymap_layers);
+	needs_update = true;
+}
+
 void handle_message(uint8_t *msg)
 {
 	int i;
 	bool pressed;
 	uint8_t row, col, ch;
 	uint8_t *end = msg + msg[0];
-	msg++;
 	bool key_change = false;
 
+	if (msg[0] == 0) {
+		if (msg[1] == KEYMAP_DUMP)
+			handle_dump((struct qmk_keymap_dump *)(msg + 2));
+		return;
+	}
+	msg++;
+
 	while (msg < end) {
 		switch (msg[0]) {
 		case MATRIX_EVENT:
@@ -160,8 +201,10 @@ void handle_message(uint8_t *msg)
 			msg += 4;
 			break;
 		case LAYER_STATE:
-			layer_state = ((uint16_t)msg[1] << 8) | (msg[2]);
-			msg += 3;
+			layer_state = ((uint32_t)msg[1] << 24) |
+				      ((uint32_t)msg[2] << 16) |
+				      ((uint32_t)msg[3] << 8) | msg[4];
+			msg += 5;
 			break;
 		case KEYCODE_HID:
 			ch = msg[1];
@@ -187,6 +230,15 @@ void handle_message(uint8_t *msg)
 			usb_passthrough = (bool)msg[1];
 			msg += 2;
 			break;
+		case SCAN_OVERRUN:
+			printf("\033[0;31mScan overrunning, settle %d us\033[0m\n",
+			       msg[1]);
+			msg += 2;
+			break;
+		case ACTIVE_PROFILE:
+			printf("\033[0;33mKeymap profile %d\033[0m\n", msg[1]);
+			msg += 2;
+			break;
 		case MSG_GENERIC:
 			printf("\033[0;33m%s\033[0m\n", msg + 1);
 			msg += msg[0];
@@ -287,10 +339,43 @@ void cairo_circle(cairo_t *cr, double x, double y, double r)
 #define LEGEND_SIZE 16
 #define CIRCLE_RADIUS 20
 
+/*
+ * Looks the key up through the active layers as the keyboard does, returns
+ * the layer the legend comes from or -1 without a keymap to look in
+ */
+static int keymap_legend(int r, int c, char *legend, size_t size)
+{
+	const char *name;
+	uint16_t code = 0;
+	int l;
+
+	if (!keymap_codes)
+		return -1;
+
+	for (l = keymap_layers - 1; l >= 0; l--) {
+		if (!(layer_state & (1UL << l)))
+			continue;
+		code = keymap_codes[(l * KEYBOARD_ROWS + r) * KEYBOARD_COLS + c];
+		if (code != 1) /* KC_TRNS */
+			break;
+	}
+	if (l < 0)
+		l = 0;
+
+	name = code < 0x100 ? keycode_to_string[code] : NULL;
+	if (!name)
+		snprintf(legend, size, "%04X", code);
+	else
+		snprintf(legend, size, "%s",
+			 strncmp(name, "KC_", 3) ? name : name + 3);
+
+	return l;
+}
+
 static void do_drawing(cairo_t *cr, GtkWidget *widget)
 {
 	int r, c, l, width, height;
-	char digit_str[2];
+	char digit_str[3];
 	char legend_str[8];
 	cairo_text_extents_t extents;
 	GtkWidget *win = gtk_widget_get_toplevel(widget);
@@ -349,9 +434,21 @@ static void do_drawing(cairo_t *cr, GtkWidget *widget)
 					cairo_set_source_rgb(cr, KEYUP_COLOR);
 				cairo_fill(cr);
 
-				if (strcmp(planck_keys[r][c]
-						   .legend[active_layer],
-					   "") == 0) {
+				l = keymap_legend(r, c, legend_str,
+						  sizeof(legend_str));
+				if (l >= 0) {
+					if (planck_keys[r][c].pressed)
+						cairo_set_source_rgb(cr, 1.0,
+								     1.0, 1.0);
+					else if (l == active_layer)
+						cairo_set_source_rgb(cr, 0.2,
+								     0.2, 0.2);
+					else
+						cairo_set_source_rgb(cr, 0.8,
+								     0.8, 0.8);
+				} else if (strcmp(planck_keys[r][c]
+							  .legend[active_layer],
+						  "") == 0) {
 					strcpy(legend_str,
 					       planck_keys[r][c].legend[0]);
 					if (planck_keys[r][c].pressed) {
@@ -493,7 +590,7 @@ int main(int argc, char *argv[])
 	// init
 
 	nls = open_unblocked_netlink();
-	send_message(nls, "hi!");
+	send_message(nls, (char[]){ KEYMAP_DUMP, 0 });
 
 	gtk_widget_show_all(window);
 
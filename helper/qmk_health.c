@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "qmk_health.h"
+
+#define DEFAULT_HEALTH_PATH "/sys/devices/platform/planck/key_health"
+
+static void __attribute__((noreturn)) usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-h] [-a] [health]\n", name);
+	fprintf(stderr, "  -a       list every key, not only the used ones\n");
+	fprintf(stderr, "  health   key_health file (default %s)\n",
+		DEFAULT_HEALTH_PATH);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct qmk_health_header header;
+	struct qmk_key_health *keys;
+	const char *path = DEFAULT_HEALTH_PATH;
+	bool all = false;
+	size_t count, i;
+	FILE *in;
+	int c;
+
+	while ((c = getopt(argc, argv, "ha")) != EOF) {
+		switch (c) {
+		case 'a':
+			all = true;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    header.magic != QMK_HEALTH_MAGIC ||
+	    header.version != QMK_HEALTH_VERSION ||
+	    header.entry_size != sizeof(*keys)) {
+		fprintf(stderr, "%s: not a qmk key health table\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	count = (size_t)header.rows * header.cols;
+	keys = calloc(count, sizeof(*keys));
+	if (!keys || fread(keys, sizeof(*keys), count, in) != count) {
+		fprintf(stderr, "%s: short key health table\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("row col   presses  releases bounces stuck last_change_ms\n");
+	for (i = 0; i < count; i++) {
+		if (!all && !keys[i].presses && !keys[i].releases)
+			continue;
+
+		printf("%3zu %3zu %9u %9u %7u %5u %u\n", i / header.cols,
+		       i % header.cols, keys[i].presses, keys[i].releases,
+		       keys[i].bounces, keys[i].stuck, keys[i].last_change_ms);
+	}
+
+	free(keys);
+	fclose(in);
+
+	return EXIT_SUCCESS;
+}
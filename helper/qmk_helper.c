@@ -97,7 +97,7 @@ void handle_message(uint8_t *msg)
             msg += 4;
             break;
         case LAYER_STATE:
-            msg += 3;
+            msg += 5;
             break;
         case ACTIVE_LAYER:
             msg += 2;
@@ -109,6 +109,15 @@ void handle_message(uint8_t *msg)
                 printf("\033[0;33mUSD Passthrough Disabled\033[0m\n");
             msg += 2;
             break;
+        case SCAN_OVERRUN:
+            printf("\033[0;31mScan overrunning, settle %d us\033[0m\n",
+                   msg[1]);
+            msg += 2;
+            break;
+        case ACTIVE_PROFILE:
+            printf("\033[0;33mKeymap profile %d\033[0m\n", msg[1]);
+            msg += 2;
+            break;
         case KEYCODE_HID:
             ch = msg[1];
             pressed = (bool)msg[2];
@@ -144,12 +153,14 @@ void handle_daemon_message(uint8_t *msg)
 
 	while (msg < end) {
 		switch (msg[0]) {
-		case MATRIX_EVENT:
-			msg += 1;
 		case LAYER_STATE:
 			msg += 1;
+		case MATRIX_EVENT:
+			msg += 2;
 		case ACTIVE_LAYER:
 		case USB_PASSTHROUGH:
+		case SCAN_OVERRUN:
+		case ACTIVE_PROFILE:
 			msg += 2;
 			break;
 		case KEYCODE_HID:
@@ -255,7 +266,7 @@ struct qmk_gadget_cfg cfg = {
 
 static void __attribute__((noreturn)) usage(char *name)
 {
-	fprintf(stderr, "Usage: %s [-hdoct]\n", name);
+	fprintf(stderr, "Usage: %s [-hdoct] [-p profile]\n", name);
 	exit(EXIT_FAILURE);
 }
 
@@ -264,7 +275,7 @@ int main(int argc, char *argv[])
 	int nls, c;
 	// signal(SIGINT, interrupt_signal);
 
-	while ((c = getopt(argc, argv, "hdoct:")) != EOF) {
+	while ((c = getopt(argc, argv, "hdoct:p:")) != EOF) {
 		switch (c) {
 		case 'h':
 			usage(argv[0]);
@@ -289,6 +300,13 @@ int main(int argc, char *argv[])
 			send_test();
 			exit(EXIT_SUCCESS);
 			break;
+		case 'p':
+			/* the payload is zeroed past the string, so 0 is sent too */
+			nls = open_netlink();
+			send_message(nls, (char[]){ ACTIVE_PROFILE, atoi(optarg), 0 });
+			close(nls);
+			exit(EXIT_SUCCESS);
+			break;
 		default:
 			usage(argv[0]);
 			break;
@@ -0,0 +1,236 @@
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "qmk_keymap.h"
+
+/*
+ * Compiles the keymap of a keyboard overlay into the binary format of
+ * include/qmk_keymap.h. The overlay is read back as source with its
+ * expressions evaluated, as printed by
+ *
+ *   dtc -I dtb -O dts keyboards/planck.dtbo
+ */
+
+#define KEY_LAYER(k) (((k) >> 26) & 0xf)
+#define KEY_ROW(k) ((((k) >> 21) & 0x1f) | (((k) >> 25) & 0x20))
+#define KEY_COL(k) ((((k) >> 16) & 0x1f) | (((k) >> 26) & 0x20))
+#define KEY_VAL(k) ((k)&0xffff)
+/* layers the entries of "<property>-high" count from */
+#define KEY_HIGH_LAYERS 16
+
+static void __attribute__((noreturn)) usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-h] [-k property] [-p profile] [-o out] [dts]\n",
+		name);
+	fprintf(stderr, "  -k property  keymap property (default qmk,keymap)\n");
+	fprintf(stderr, "  -p profile   profile to load the keymap into (default 0)\n");
+	fprintf(stderr, "  -o out       output file (default stdout)\n");
+	fprintf(stderr, "  dts          decompiled overlay (default stdin)\n");
+	exit(EXIT_FAILURE);
+}
+
+static char *read_all(FILE *in)
+{
+	size_t size = 0, len = 0, n;
+	char *buf = NULL;
+
+	do {
+		if (len + 4096 + 1 > size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+			if (!buf) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = fread(buf + len, 1, size - len - 1, in);
+		len += n;
+	} while (n);
+
+	buf[len] = '\0';
+	return buf;
+}
+
+/* returns the cells of "name = <...>;", NULL when it is not there */
+static uint32_t *read_cells(const char *dts, const char *name, size_t *count)
+{
+	char pattern[128];
+	const char *p;
+	char *end;
+	uint32_t *cells = NULL;
+	size_t size = 0;
+
+	snprintf(pattern, sizeof(pattern), "%s = <", name);
+	p = strstr(dts, pattern);
+	while (p && p != dts && p[-1] != ' ' && p[-1] != '\t' && p[-1] != '\n')
+		p = strstr(p + 1, pattern);
+	if (!p)
+		return NULL;
+
+	p += strlen(pattern);
+	*count = 0;
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (*p == '>' || !*p)
+			break;
+
+		if (*count == size) {
+			size = size ? size * 2 : 256;
+			cells = realloc(cells, size * sizeof(*cells));
+			if (!cells) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		cells[(*count)++] = strtoul(p, &end, 0);
+		if (end == p) {
+			fprintf(stderr, "%s: cannot parse \"%.16s\"\n", name, p);
+			exit(EXIT_FAILURE);
+		}
+		p = end;
+	}
+
+	return cells;
+}
+
+static void put_keys(uint16_t *keycodes, const char *name,
+		     const uint32_t *keys, size_t count, unsigned int base,
+		     unsigned int layers, unsigned int rows, unsigned int cols)
+{
+	unsigned int layer, row, col;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		layer = base + KEY_LAYER(keys[i]);
+		row = KEY_ROW(keys[i]);
+		col = KEY_COL(keys[i]);
+		if (layer >= layers || row >= rows || col >= cols) {
+			fprintf(stderr, "%s: entry 0x%x out of range\n", name,
+				keys[i]);
+			exit(EXIT_FAILURE);
+		}
+		keycodes[(layer * rows + row) * cols + col] =
+			htole16(KEY_VAL(keys[i]));
+	}
+}
+
+static unsigned int read_u32(const char *dts, const char *name)
+{
+	uint32_t *cells, value;
+	size_t count;
+
+	cells = read_cells(dts, name, &count);
+	if (!cells || count != 1) {
+		fprintf(stderr, "no %s in the overlay\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	value = cells[0];
+	free(cells);
+	return value;
+}
+
+int main(int argc, char *argv[])
+{
+	struct qmk_keymap_header header = { 0 };
+	const char *property = "qmk,keymap";
+	const char *out_path = NULL;
+	unsigned int layers, rows, cols;
+	uint32_t *keys;
+	uint16_t *keycodes;
+	size_t count, size;
+	char high[128];
+	FILE *in = stdin, *out = stdout;
+	char *dts;
+	int c;
+
+	while ((c = getopt(argc, argv, "hk:p:o:")) != EOF) {
+		switch (c) {
+		case 'k':
+			property = optarg;
+			break;
+		case 'p':
+			header.profile = htole16(atoi(optarg));
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind < argc) {
+		in = fopen(argv[optind], "r");
+		if (!in) {
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	dts = read_all(in);
+
+	layers = read_u32(dts, "keypad,num-layers");
+	rows = read_u32(dts, "keypad,num-rows");
+	cols = read_u32(dts, "keypad,num-columns");
+
+	header.magic = htole32(QMK_KEYMAP_MAGIC);
+	header.version = htole16(QMK_KEYMAP_VERSION);
+	header.layers = htole16(layers);
+	header.rows = htole16(rows);
+	header.cols = htole16(cols);
+
+	keys = read_cells(dts, property, &count);
+	if (!keys) {
+		fprintf(stderr, "no %s in the overlay\n", property);
+		exit(EXIT_FAILURE);
+	}
+
+	size = (size_t)layers * rows * cols;
+	keycodes = calloc(size, sizeof(*keycodes));
+	if (!keycodes) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	put_keys(keycodes, property, keys, count, 0, layers, rows, cols);
+	free(keys);
+
+	snprintf(high, sizeof(high), "%s-high", property);
+	keys = read_cells(dts, high, &count);
+	if (keys)
+		put_keys(keycodes, high, keys, count, KEY_HIGH_LAYERS, layers,
+			 rows, cols);
+
+	header.crc = htole32(crc32(0, (const Bytef *)keycodes,
+				   size * sizeof(*keycodes)));
+
+	if (out_path) {
+		out = fopen(out_path, "wb");
+		if (!out) {
+			perror(out_path);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+	    fwrite(keycodes, sizeof(*keycodes), size, out) != size) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(out);
+	free(keycodes);
+	free(keys);
+	free(dts);
+
+	return EXIT_SUCCESS;
+}
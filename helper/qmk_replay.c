@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qmk_capture.h"
+
+#define DEFAULT_REPLAY_PATH "/sys/kernel/debug/qmk/planck/replay"
+
+static void __attribute__((noreturn)) usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-h] [-f] [-s speed] [-o replay] capture\n",
+		name);
+	fprintf(stderr, "  -f         replay as fast as possible\n");
+	fprintf(stderr, "  -s speed   playback speed factor (default 1.0)\n");
+	fprintf(stderr, "  -o replay  debugfs replay file (default %s)\n",
+		DEFAULT_REPLAY_PATH);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+int main(int argc, char *argv[])
+{
+	struct qmk_capture_header header;
+	const char *replay_path = DEFAULT_REPLAY_PATH;
+	double speed = 1.0;
+	bool fast = false;
+	uint64_t start, deadline, records = 0;
+	uint32_t *record;
+	size_t size;
+	FILE *in;
+	int out, c;
+
+	while ((c = getopt(argc, argv, "hfs:o:")) != EOF) {
+		switch (c) {
+		case 'f':
+			fast = true;
+			break;
+		case 's':
+			speed = atof(optarg);
+			if (speed <= 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			replay_path = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	in = fopen(argv[optind], "rb");
+	if (!in) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    header.magic != QMK_CAPTURE_MAGIC ||
+	    header.version != QMK_CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a qmk capture\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	out = open(replay_path, O_WRONLY);
+	if (out < 0) {
+		perror(replay_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (write(out, &header, sizeof(header)) != sizeof(header)) {
+		fprintf(stderr, "replay rejected: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	size = QMK_CAPTURE_RECORD_SIZE(header.words);
+	record = malloc(size);
+	if (!record) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("replaying %dx%d matrix from %s\n", header.rows, header.cols,
+	       argv[optind]);
+
+	start = deadline = now_ns();
+	while (fread(record, size, 1, in) == 1) {
+		if (!fast) {
+			deadline += (uint64_t)(record[0] * 1000ULL / speed);
+			sleep_until(deadline);
+		}
+
+		if (write(out, record, size) != (ssize_t)size) {
+			fprintf(stderr, "replay failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		records++;
+	}
+
+	printf("%llu scans replayed in %llu us\n", (unsigned long long)records,
+	       (unsigned long long)((now_ns() - start) / 1000));
+
+	free(record);
+	close(out);
+	fclose(in);
+
+	return EXIT_SUCCESS;
+}
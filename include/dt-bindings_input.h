@@ -14,7 +14,10 @@
 #include <qmk/keycodes/quantum.h>
 
 #define LAYER_MATRIX_KEY(layer, row, col, code)                                \
-	((((layer)&0xF) << 26) | (((row)&0x1F) << 21) | (((col)&0x1F) << 16) | \
-	 ((code)&0xFFFF))
+	((((layer)&0xF) << 26) | (((row)&0x1F) << 21) | (((row)&0x20) << 25) | \
+	 (((col)&0x1F) << 16) | (((col)&0x20) << 26) | ((code)&0xFFFF))
+
+/* switches to keymap profile n, see qmk,profile-keymaps */
+#define PROFILE(n) (0xFFE0 + ((n)&0x7))
 
 #endif /* _QMK_DT_BINDINGS_INPUT_H */
@@ -3,28 +3,79 @@
 #define _QMK_H
 
 #include <linux/types.h>
+#include <linux/cpumask.h>
+#include <linux/export.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
+#include <linux/sched/prio.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
 #include <qmk/types.h>
 
-#define MATRIX_MAX_LAYERS 16
-#define MATRIX_MAX_ROWS 32
-#define MATRIX_MAX_COLS 32
+#define MATRIX_MAX_LAYERS 32
+/* layers a KEY() entry can address, see qmk_parse_keymap() for the rest */
+#define MATRIX_KEY_LAYERS 16
+#define MATRIX_MAX_ROWS 64
+#define MATRIX_MAX_COLS 64
+/* sense lines are the rows, or the columns when strobing rows */
+#define MATRIX_MAX_SENSE                                                       \
+	(MATRIX_MAX_ROWS > MATRIX_MAX_COLS ? MATRIX_MAX_ROWS : MATRIX_MAX_COLS)
 
+/* input-polldev's default when no poll-interval is given */
+#define QMK_POLL_INTERVAL_DEFAULT 500
+/* bounds of the settings sysfs and configfs take, see qmk_params.c */
+#define QMK_POLL_INTERVAL_MIN 1
+#define QMK_COL_SCAN_DELAY_MAX_US USEC_PER_MSEC
+#define QMK_DEBOUNCE_MAX_MS 1000
+#define QMK_SCAN_PRIORITY_DEFAULT (MAX_USER_RT_PRIO / 2)
+#define QMK_IDLE_SCANS_DEFAULT 50
+#define QMK_GOVERNOR_LEVELS 8
+#define QMK_ENCODER_RESOLUTION_DEFAULT 4
+#define QMK_STUCK_MS_DEFAULT 30000
+#define QMK_DEBOUNCE_MAX_US_DEFAULT 10000
+/* consecutive overruns before userspace is told */
+#define QMK_OVERRUN_STREAK 8
+/* layer states whose effective keymaps are kept, see qmk_effective.c */
+#define QMK_EFFECTIVE_SLOTS 4
+/* resident keymaps, selected with the PROFILE(n) keycodes */
+#define QMK_MAX_PROFILES 8
+#define QMK_KC_PROFILE 0xFFE0
+/* sends HID keycodes to userspace instead of the input device */
+#define QMK_KC_USB_PASSTHROUGH 0xFFF1
+
+/*
+ * Bits 30 and 31 carry the sixth row and column bit, so keymaps written for
+ * 32x32 matrices keep their encoding.
+ */
 #define KEY(layer, row, col, val)                                              \
-	((((layer) & (MATRIX_MAX_LAYERS 1)) << 26) |                           \
-	 (((row) & (MATRIX_MAX_ROWS - 1)) << 21) |                             \
-	 (((col) & (MATRIX_MAX_COLS - 1)) << 16) | ((val)&0xffff))
+	((((layer) & (MATRIX_KEY_LAYERS - 1)) << 26) |                         \
+	 (((row)&0x1fU) << 21) | (((row)&0x20U) << 25) |                       \
+	 (((col)&0x1fU) << 16) | (((col)&0x20U) << 26) | ((val)&0xffff))
 
 #define KEY_LAYER(k) (((k) >> 26) & 0xf)
-#define KEY_ROW(k) (((k) >> 21) & 0x1f)
-#define KEY_COL(k) (((k) >> 16) & 0x1f)
+#define KEY_ROW(k) ((((k) >> 21) & 0x1f) | (((k) >> 25) & 0x20))
+#define KEY_COL(k) ((((k) >> 16) & 0x1f) | (((k) >> 26) & 0x20))
 #define KEY_VAL(k) ((k)&0xffff)
 
 #define QMK_MATRIX_SCAN_CODE(layer, row, col, layer_shift, row_shift)          \
 	(((layer) << (layer_shift)) + ((row) << (row_shift)) + (col))
 
+/* scancode of a key as seen by userspace, in MSC_SCAN and EVIOCSKEYCODE */
+#define QMK_SCANCODE(layer, row, col) (((layer) << 16) | ((row) << 8) | (col))
+#define QMK_SCANCODE_NONE 0xffffffff
+
+enum qmk_strobe {
+	QMK_STROBE_COLS,
+	QMK_STROBE_ROWS,
+	QMK_STROBE_AUTO,
+};
+
 #define KEY_PRESSED 1
 #define KEY_RELEASED 0
 /**
@@ -52,6 +103,10 @@ struct matrix_keymap_data {
  * @col_scan_delay_us: delay, measured in microseconds, that is
  *  needed before we can keypad after activating column gpio
  * @debounce_ms: debounce interval in milliseconds
+ * @debounce_adaptive: learn a debounce interval for every key instead
+ * @debounce_min_us: shortest interval a key can learn
+ * @debounce_max_us: longest interval a key can learn, and the one every
+ *  key starts with
  * @clustered_irq: may be specified if interrupts of all row/column GPIOs
  *  are bundled to one single irq
  * @clustered_irq_flags: flags that are needed for the clustered irq
@@ -61,6 +116,40 @@ struct matrix_keymap_data {
  * @no_autorepeat: disable key autorepeat
  * @drive_inactive_cols: drive inactive columns during scan, rather than
  *  making them inputs.
+ * @anti_ghost: hold back keys made ambiguous by ghosting, for matrices
+ *  without diodes
+ * @strobe: which side of the matrix is strobed, QMK_STROBE_AUTO strobes the
+ *  side with fewer lines
+ * @direct_pins: no matrix, each col_gpios entry is a key of its own that is
+ *  read on its edge interrupts instead of being polled
+ * @analog: rows are sensed through IIO channels (e.g. Hall-effect switches
+ *  on ADCs) instead of row_gpios
+ * @analog_actuation: per-key reading at which a key is pressed, row-major
+ * @analog_release: per-key reading at which a key is released, row-major
+ * @analog_rapid_trigger: travel in ADC counts that releases or re-actuates
+ *  a key when it changes direction, 0 disables rapid trigger
+ * @overrun_degrade: halve the settle delay whenever scans keep overrunning
+ *  their interval
+ * @scan_thread: scan from a dedicated SCHED_FIFO kthread instead of the
+ *  shared workqueue used by input-polldev
+ * @scan_priority: SCHED_FIFO priority of the scan thread
+ * @scan_cpus: CPUs the scan thread may run on
+ * @scan_interval_max: scan interval in milliseconds once the keyboard is
+ *  idle, the governor never slows down below poll_interval if this is 0
+ * @idle_scans: quiet scans before the governor steps to a slower rate
+ * @stuck_ms: a key held this long while nothing else happens is counted as
+ *  stuck, 0 disables stuck detection
+ * @encoder_gpios: A and B phase gpio of each rotary encoder
+ * @encoder_keys: clockwise and counter-clockwise keycode of each encoder
+ * @num_encoders: number of rotary encoders
+ * @encoder_resolution: quadrature transitions per detent
+ * @encoder_accel_ms: detents closer together than this are repeated, 0
+ *  disables acceleration
+ * @keymap_firmware: binary keymap requested from userspace once the device
+ *  is up, replacing the one in @keymap_data
+ * @keymap_bin: binary keymap, in the format keymap_bin takes, loaded at
+ *  probe in place of @keymap_data
+ * @keymap_bin_size: size of @keymap_bin
  *
  * This structure represents platform-specific data that use used by
  * qmk driver to perform proper initialization.
@@ -72,11 +161,18 @@ struct qmk_platform_data {
 	const unsigned int *row_gpios;
 	const unsigned int *col_gpios;
 
+	unsigned int num_layers;
+	unsigned int num_row_gpios;
+	unsigned int num_col_gpios;
+
 	unsigned int col_scan_delay_us;
 	unsigned int poll_interval;
 
 	/* key debounce interval in milli-second */
 	unsigned int debounce_ms;
+	bool debounce_adaptive;
+	unsigned int debounce_min_us;
+	unsigned int debounce_max_us;
 
 	unsigned int clustered_irq;
 	unsigned int clustered_irq_flags;
@@ -85,6 +181,28 @@ struct qmk_platform_data {
 	bool wakeup;
 	bool no_autorepeat;
 	bool drive_inactive_cols;
+	bool anti_ghost;
+	enum qmk_strobe strobe;
+	bool overrun_degrade;
+	bool direct_pins;
+	bool analog;
+	const u32 *analog_actuation;
+	const u32 *analog_release;
+	unsigned int analog_rapid_trigger;
+	bool scan_thread;
+	unsigned int scan_priority;
+	struct cpumask scan_cpus;
+	unsigned int scan_interval_max;
+	unsigned int idle_scans;
+	unsigned int stuck_ms;
+	const unsigned int *encoder_gpios;
+	const u32 *encoder_keys;
+	unsigned int num_encoders;
+	unsigned int encoder_resolution;
+	unsigned int encoder_accel_ms;
+	const char *keymap_firmware;
+	const void *keymap_bin;
+	size_t keymap_bin_size;
 	int (*enable)(struct device *dev);
 	void (*disable)(struct device *dev);
 
@@ -95,6 +213,67 @@ struct qmk_platform_data {
 	unsigned char report_desc[];
 };
 
+/**
+ * struct qmk_governor - activity-adaptive scan rate
+ * @min_interval: scan interval in ms while keys are active
+ * @max_interval: scan interval in ms once the keyboard is idle
+ * @idle_scans: quiet scans at one rate before stepping to the next slower
+ *  one
+ * @levels: number of rates, each twice as slow as the previous one
+ * @level: current rate, 0 being the fastest
+ * @quiet: quiet scans seen at the current rate
+ * @interval: current scan interval in ms
+ * @since: time the current rate was entered
+ * @level_ns: time spent at each rate
+ */
+struct qmk_governor {
+	unsigned int min_interval;
+	unsigned int max_interval;
+	unsigned int idle_scans;
+	unsigned int levels;
+	unsigned int level;
+	unsigned int quiet;
+	unsigned int interval;
+	u64 since;
+	u64 level_ns[QMK_GOVERNOR_LEVELS];
+};
+
+/**
+ * struct qmk_scan_params - scan settings that can be changed at runtime
+ * @poll_interval: scan interval in ms while keys are active
+ * @scan_interval_max: scan interval in ms once the keyboard is idle
+ * @idle_scans: quiet scans before the governor steps to a slower rate
+ * @col_scan_delay_us: settle time after driving a strobe line
+ * @debounce_ms: fixed debounce window, unused with adaptive debounce
+ * @drive_inactive_cols: drive idle strobe lines instead of floating them
+ * @active_low: gpio polarity
+ *
+ * Published through a double buffer, see qmk_params.c.
+ */
+struct qmk_scan_params {
+	unsigned int poll_interval;
+	unsigned int scan_interval_max;
+	unsigned int idle_scans;
+	unsigned int col_scan_delay_us;
+	unsigned int debounce_ms;
+	unsigned int drive_inactive_cols;
+	unsigned int active_low;
+};
+
+struct gpio_desc;
+struct qmk_analog;
+struct qmk_capture;
+struct qmk_debounce;
+struct qmk_effective;
+struct qmk_encoders;
+struct qmk_health_header;
+struct qmk_key_health;
+struct qmk_keymap_dump;
+struct qmk_keymap_header;
+struct qmk_live_keymap;
+struct qmk_sparse_keymap;
+struct task_struct;
+
 struct qmk_module {
 	const struct qmk_platform_data *pdata;
 	struct qmk_keyboard *keyboard;
@@ -104,41 +283,299 @@ struct qmk_module {
 	unsigned int layer_shift;
 	unsigned int row_shift;
 
-	unsigned long layer_state;
+	/* matrix state bitmaps, see qmk_alloc_matrix() */
+	unsigned long *last_key_state;
+	unsigned long *current_key_state;
+	unsigned long *changed_key_state;
+	unsigned long *ghost_mask;
+	unsigned int matrix_bits;
+	unsigned int col_shift;
+
+	/* lines driven and read during a scan, see qmk_setup_strobe() */
+	const unsigned int *strobe_gpios;
+	const unsigned int *sense_gpios;
+	unsigned int num_strobe;
+	unsigned int num_sense;
+	/* sense lines whose wakeup interrupt is armed while suspended */
+	DECLARE_BITMAP(wake_gpios, MATRIX_MAX_SENSE);
+	bool transposed;
+	bool strobe_active_low;
+
+	/* sense lines read as one array on sleeping (expander) GPIO chips */
+	struct gpio_desc **sense_descs;
+	unsigned long *sense_values;
 
-	DECLARE_BITMAP(disabled_gpios, MATRIX_MAX_ROWS);
+	/* ADC channels sensed instead of gpios, see qmk_analog.c */
+	struct qmk_analog *analog;
 
-	uint32_t last_key_state[MATRIX_MAX_COLS];
-	uint32_t current_key_state[MATRIX_MAX_COLS];
 	struct delayed_work work;
 	spinlock_t lock;
+	/* serializes the live scan with replays */
+	struct mutex scan_lock;
 	bool scan_pending;
 	bool stopped;
 	bool gpio_all_disabled;
+	bool replaying;
+	bool wakeup_irqs;
+
+	struct dentry *debugfs;
+	struct qmk_capture *capture;
+	struct qmk_encoders *encoders;
+
+	/* dedicated scan thread, see qmk_thread.c */
+	struct mutex thread_lock;
+	struct task_struct *scan_task;
+	bool scan_thread;
+	unsigned int scan_priority;
+	struct cpumask scan_cpus;
+
+	struct qmk_governor governor;
+
+	/*
+	 * scan settings changed through sysfs, picked up by the next scan,
+	 * see qmk_params.c
+	 */
+	struct mutex params_lock;
+	seqcount_t params_seq;
+	struct qmk_scan_params params;
+	unsigned int params_applied;
+	struct qmk_scan_params scan_params;
+
+	/* per-key debounce, see qmk_debounce.c */
+	struct qmk_debounce *debounce;
+	/* scratch debounce state while replaying */
+	struct qmk_debounce *replay_debounce;
+
+	/* rescans direct pins when a held back change is due */
+	struct hrtimer direct_timer;
+	struct work_struct direct_work;
+
+	/* hold back ambiguous keys on diodeless matrices */
+	bool anti_ghost;
+
+	/* scan cost accounting, reported through sysfs */
+	u64 scan_count;
+	u64 scan_ns;
+	u64 bus_ns;
+	u64 event_count;
+	u64 event_ns;
+	u64 ghost_count;
+	/* keycodes neither libqmk nor a registered handler took */
+	u64 unhandled_count;
+
+	/* scan deadline accounting, see qmk_scan_deadline() */
+	unsigned int settle_us;
+	u64 scan_due_ns;
+	u64 late_ns;
+	u64 late_max_ns;
+	u64 scan_max_ns;
+	u64 overrun_count;
+	unsigned int overrun_streak;
+
+	/* per-key health table, see qmk_health.c */
+	struct qmk_health_header *health_table;
+	struct qmk_key_health *health;
+	size_t health_size;
+	u64 health_activity_ns;
+	bool health_stuck_checked;
+
+	/* keymap reloads, see qmk_reload.c */
+	struct srcu_struct keymap_srcu;
+	struct mutex reload_lock;
+	void *reload_blob;
+	size_t reload_size;
+	size_t reload_staged;
+	/* completed with complete_all(), so it can be waited for more than once */
+	struct completion keymap_firmware_done;
+	unsigned int keymap_gen;
+	/* keymap in use, swapped under input_dev->event_lock */
+	struct qmk_live_keymap *live;
+	/* resident keymaps, kept sparse and guarded by reload_lock */
+	struct qmk_sparse_keymap *profiles[QMK_MAX_PROFILES];
+	unsigned int num_profiles;
+	unsigned int profile;
+
+	/* keycodes resolved for recent layer states, see qmk_effective.c */
+	struct qmk_effective *effective;
+
+	/* single keys remapped through the input core, see qmk_remap.c */
+	struct work_struct remap_work;
+	unsigned long remap_flags;
+	/* MSC_SCAN of the matrix event being processed */
+	u32 event_scancode;
+
+	/* keymap and layer snapshots, see qmk_dump.c */
+	struct list_head dump_node;
+	struct mutex dump_lock;
+	struct qmk_keymap_dump *dump;
+	size_t dump_size;
 };
 
 int queue_socket_message_f(const char *fmt, ...);
 void queue_socket_message(uint8_t * msg, uint8_t msg_size);
 void send_socket_message(void);
+int unicast_socket_message(u32 portid, const void *data, size_t size);
 
 int gadget_init(void);
 void gadget_exit(void);
 
+int qmk_configfs_init(void);
+void qmk_configfs_exit(void);
+
+int qmk_protocol_init(void);
+void qmk_protocol_exit(void);
+void qmk_dispatch_exit(void);
+
 bool process_qkm(struct qmk_keyboard *keyboard, qmk_keycode_t *keycode,
 		 bool pressed);
+void send_keycode(struct qmk_keyboard *keyboard, hid_keycode_t keycode,
+		  bool pressed);
 
+int qmk_alloc_matrix(struct qmk_module *module);
+void qmk_setup_strobe(struct qmk_module *module);
 int qmk_init_gpio(struct platform_device *pdev, struct qmk_module *module);
 void qmk_free_gpio(struct qmk_module *module);
+int qmk_init_wakeup(struct qmk_module *module);
+void qmk_idle_gpio(struct qmk_module *module);
+void qmk_arm_gpio(struct qmk_module *module);
+
+int qmk_direct_init(struct platform_device *pdev, struct qmk_module *module);
+void qmk_direct_free(struct qmk_module *module);
+void qmk_direct_start(struct qmk_module *module);
+void qmk_direct_stop(struct qmk_module *module);
+void qmk_direct_read(struct qmk_module *module);
+
+int qmk_debounce_init(struct qmk_module *module);
+void qmk_debounce(struct qmk_module *module, struct qmk_debounce *debounce,
+		  u64 now);
+struct qmk_debounce *qmk_debounce_replay(struct qmk_module *module);
+u64 qmk_debounce_due(struct qmk_debounce *debounce);
+void qmk_debounce_free(struct qmk_debounce *debounce);
+void qmk_debounce_set(struct qmk_module *module, unsigned int debounce_ms);
+
+void qmk_params_init(struct qmk_module *module);
+void qmk_params_read(struct qmk_module *module,
+		     struct qmk_scan_params *params);
+struct qmk_scan_params *qmk_params_begin(struct qmk_module *module);
+void qmk_params_commit(struct qmk_module *module);
+void qmk_params_apply(struct qmk_module *module);
+void qmk_set_polarity(struct qmk_module *module, bool active_low);
+
+int qmk_health_init(struct qmk_module *module);
+void qmk_health_event(struct qmk_module *module, unsigned int row,
+		      unsigned int col, bool pressed, u64 now);
+void qmk_health_bounce(struct qmk_module *module, unsigned int row,
+		       unsigned int col);
+void qmk_health_scan(struct qmk_module *module, u64 now);
+ssize_t qmk_health_read(struct qmk_module *module, char *buf, loff_t off,
+			size_t count);
+void qmk_health_reset(struct qmk_module *module);
+
+int qmk_analog_init(struct qmk_module *module);
+void qmk_analog_read(struct qmk_module *module, unsigned int col);
+void qmk_analog_start(struct qmk_module *module);
+void qmk_analog_stop(struct qmk_module *module);
+
+int qmk_encoder_init(struct qmk_module *module);
+void qmk_encoder_exit(struct qmk_module *module);
+void qmk_encoder_start(struct qmk_module *module);
+void qmk_encoder_stop(struct qmk_module *module);
+
+int qmk_effective_init(struct qmk_module *module);
+bool qmk_effective_lookup(struct qmk_module *module,
+			  struct qmk_matrix_event *event,
+			  qmk_keycode_t *keycode);
+void qmk_effective_release(struct qmk_module *module, u16 code);
+void qmk_effective_invalidate(struct qmk_module *module, unsigned int key);
+
+void qmk_remap_init(struct qmk_module *module);
+void qmk_remap_exit(struct qmk_module *module);
+void qmk_remap_sync(struct qmk_module *module);
+
+int qmk_reload_init(struct qmk_module *module);
+void qmk_reload_exit(struct qmk_module *module);
+int qmk_reload_request(struct qmk_module *module);
+ssize_t qmk_reload_write(struct qmk_module *module, const char *buf,
+			 loff_t off, size_t count);
+ssize_t qmk_reload_read(struct qmk_module *module, char *buf, loff_t off,
+			size_t count);
+int qmk_profile_select(struct qmk_module *module, unsigned int profile);
+const unsigned short *qmk_reload_current(struct qmk_module *module,
+					 unsigned int *profile);
+void qmk_reload_export(struct qmk_module *module, const unsigned short *keymap,
+		       unsigned int profile, struct qmk_keymap_header *header);
+
+void qmk_dump_init(struct qmk_module *module);
+void qmk_dump_exit(struct qmk_module *module);
+ssize_t qmk_dump_read(struct qmk_module *module, char *buf, loff_t off,
+		      size_t count);
+void qmk_dump_request(u32 portid);
+void qmk_profile_request(unsigned int profile);
+
+struct qmk_sparse_keymap *qmk_sparse_build(struct qmk_module *module,
+					   const unsigned short *keymap,
+					   unsigned int layers);
+void qmk_sparse_expand(struct qmk_module *module,
+		       const struct qmk_sparse_keymap *sparse,
+		       unsigned short *keymap);
+size_t qmk_sparse_size(const struct qmk_sparse_keymap *sparse);
+void qmk_sparse_free(struct qmk_sparse_keymap *sparse);
 
 struct attribute_group *get_qmk_group(void);
 void qmk_scan(struct input_polled_dev *polled_dev);
+void qmk_scan_matrix(struct qmk_module *module);
+bool qmk_analyze_state(struct qmk_module *module, u64 now);
+
+int qmk_capture_init(struct qmk_module *module);
+void qmk_capture_exit(struct qmk_module *module);
+void qmk_capture_scan(struct qmk_module *module);
+
+void __qmk_governor_init(struct qmk_module *module, unsigned int min_interval,
+			 unsigned int max_interval, unsigned int idle_scans);
+void qmk_governor_init(struct qmk_module *module, unsigned int min_interval,
+		       unsigned int max_interval, unsigned int idle_scans);
+void qmk_governor_reset(struct qmk_module *module);
+void qmk_governor_update(struct qmk_module *module, bool active);
+unsigned int qmk_governor_level_interval(const struct qmk_governor *governor,
+					 unsigned int level);
+
+int qmk_thread_start(struct qmk_module *module);
+void qmk_thread_stop(struct qmk_module *module);
+int qmk_thread_set_priority(struct qmk_module *module, unsigned int priority);
+int qmk_thread_set_cpus(struct qmk_module *module,
+			const struct cpumask *cpus);
+
 int qmk_build_keymap(const struct matrix_keymap_data *keymap_data,
 		     const char *keymap_name, unsigned int layers,
 		     unsigned int rows, unsigned int cols,
 		     unsigned short *keymap, struct input_dev *input_dev);
+unsigned short *qmk_build_profile(const char *keymap_name, unsigned int layers,
+				  unsigned int rows, unsigned int cols,
+				  struct input_dev *input_dev);
 int qmk_parse_properties(struct device *dev, unsigned int *layers,
 			 unsigned int *rows, unsigned int *cols);
 
+/*
+ * The KUnit suites are a module of their own, qmk_test.ko, so the helpers
+ * they call are only exported, and the static ones only made visible, in
+ * kernels with KUnit.
+ */
+#if IS_ENABLED(CONFIG_KUNIT)
+#define QMK_VISIBLE_IF_KUNIT
+#define QMK_EXPORT_IF_KUNIT(symbol) EXPORT_SYMBOL_GPL(symbol)
+
+bool qmk_map_key(struct input_dev *input_dev, unsigned short *keymap,
+		 unsigned int layers, unsigned int layer_shift,
+		 unsigned int rows, unsigned int cols, unsigned int row_shift,
+		 unsigned int layer_base, unsigned int key);
+int qmk_parse_keymap(const char *propname, unsigned int layers,
+		     unsigned int rows, unsigned int cols,
+		     unsigned short *keymap, struct input_dev *input_dev);
+#else
+#define QMK_VISIBLE_IF_KUNIT static
+#define QMK_EXPORT_IF_KUNIT(symbol)
+#endif
+
 #define qmk_parse_of_params qmk_parse_properties
 
 #endif /* _QMK_H */
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _QMK_CAPTURE_H
+#define _QMK_CAPTURE_H
+
+#include <linux/types.h>
+
+#define QMK_CAPTURE_MAGIC 0x434b4d51 /* "QMKC" */
+#define QMK_CAPTURE_VERSION 1
+
+/**
+ * struct qmk_capture_header - start of every capture stream
+ * @magic: QMK_CAPTURE_MAGIC
+ * @version: QMK_CAPTURE_VERSION
+ * @words: number of 32 bit matrix state words in each record
+ * @rows: number of matrix rows of the captured keyboard
+ * @cols: number of matrix columns of the captured keyboard
+ *
+ * The header is followed by records, each made of a __u32 holding the
+ * microseconds elapsed since the previous record and @words words of raw
+ * matrix state as read by the scan.
+ */
+struct qmk_capture_header {
+	__u32 magic;
+	__u16 version;
+	__u16 words;
+	__u16 rows;
+	__u16 cols;
+};
+
+#define QMK_CAPTURE_RECORD_SIZE(words) (sizeof(__u32) * ((words) + 1))
+
+#endif /* _QMK_CAPTURE_H */
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _QMK_DISPATCH_H
+#define _QMK_DISPATCH_H
+
+#include <linux/types.h>
+
+struct qmk_keyboard;
+
+/**
+ * struct qmk_keycode_handler - handles a range of quantum keycodes
+ * @first: first keycode handled
+ * @last: last keycode handled, inclusive
+ * @process: called on every press and release of a keycode in range, from
+ *  the scan thread with scan_lock held. It may sleep, but must not wait on
+ *  the scan. Returns whether the keycode was consumed.
+ * @data: passed back to @process
+ *
+ * The handler is not copied and has to stay around until
+ * qmk_unregister_keycodes() returns.
+ */
+struct qmk_keycode_handler {
+	u16 first;
+	u16 last;
+	bool (*process)(struct qmk_keyboard *keyboard, u16 keycode,
+			bool pressed, void *data);
+	void *data;
+};
+
+int qmk_register_keycodes(const struct qmk_keycode_handler *handler);
+void qmk_unregister_keycodes(const struct qmk_keycode_handler *handler);
+
+#endif /* _QMK_DISPATCH_H */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _QMK_HEALTH_H
+#define _QMK_HEALTH_H
+
+#include <linux/types.h>
+
+#define QMK_HEALTH_MAGIC 0x484b4d51 /* "QMKH" */
+#define QMK_HEALTH_VERSION 1
+
+/**
+ * struct qmk_health_header - start of the key_health table
+ * @magic: QMK_HEALTH_MAGIC
+ * @version: QMK_HEALTH_VERSION
+ * @entry_size: size of each struct qmk_key_health that follows
+ * @rows: number of matrix rows
+ * @cols: number of matrix columns
+ *
+ * The header is followed by rows * cols entries in row-major order.
+ */
+struct qmk_health_header {
+	__u32 magic;
+	__u16 version;
+	__u16 entry_size;
+	__u16 rows;
+	__u16 cols;
+};
+
+/**
+ * struct qmk_key_health - wear and failure counters of one key
+ * @presses: times the key was reported pressed
+ * @releases: times the key was reported released
+ * @bounces: transitions held back by debounce, saturating
+ * @stuck: times the key was held past the stuck threshold while nothing
+ *  else happened on the matrix, saturating
+ * @last_change_ms: monotonic time of the last change in ms, wrapping
+ */
+struct qmk_key_health {
+	__u32 presses;
+	__u32 releases;
+	__u16 bounces;
+	__u16 stuck;
+	__u32 last_change_ms;
+};
+
+#endif /* _QMK_HEALTH_H */
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _QMK_KEYMAP_H
+#define _QMK_KEYMAP_H
+
+#include <linux/types.h>
+
+#define QMK_KEYMAP_MAGIC 0x4b4b4d51 /* "QMKK" */
+#define QMK_KEYMAP_VERSION 1
+
+/**
+ * struct qmk_keymap_header - start of a binary keymap
+ * @magic: QMK_KEYMAP_MAGIC
+ * @version: QMK_KEYMAP_VERSION
+ * @layers: number of layers that follow, at most the keyboard's
+ * @rows: number of matrix rows, must match the keyboard
+ * @cols: number of matrix columns, must match the keyboard
+ * @profile: profile the keymap is loaded into, see QMK_MAX_PROFILES
+ * @reserved: must be zero
+ * @crc: zlib compatible CRC-32 of the keycodes
+ *
+ * The header is followed by layers * rows * cols __le16 keycodes, layer by
+ * layer in row-major order. Layers not included are cleared to KC_NO.
+ * Every field is little endian, so keymaps can be built on another host.
+ */
+struct qmk_keymap_header {
+	__le32 magic;
+	__le16 version;
+	__le16 layers;
+	__le16 rows;
+	__le16 cols;
+	__le16 profile;
+	__le16 reserved;
+	__le32 crc;
+};
+
+#define QMK_KEYMAP_SIZE(layers, rows, cols)                                    \
+	(sizeof(struct qmk_keymap_header) +                                    \
+	 sizeof(__le16) * (layers) * (rows) * (cols))
+
+#define QMK_DUMP_MAGIC 0x444b4d51 /* "QMKD" */
+#define QMK_DUMP_VERSION 1
+
+/**
+ * struct qmk_keymap_dump - keymap and layers of a keyboard at one instant
+ * @magic: QMK_DUMP_MAGIC
+ * @version: QMK_DUMP_VERSION
+ * @num_profiles: keymap profiles loaded
+ * @active_layer: highest active layer
+ * @layer_state: one bit per active layer
+ * @keymap: the keymap in use, for every layer
+ *
+ * @keymap is followed by its keycodes, so the dump from sizeof(u32) * 3 on
+ * is a keymap as keymap_bin takes it. Little endian, like the keymap.
+ */
+struct qmk_keymap_dump {
+	__le32 magic;
+	__le16 version;
+	__u8 num_profiles;
+	__u8 active_layer;
+	__le32 layer_state;
+	struct qmk_keymap_header keymap;
+};
+
+#define QMK_DUMP_SIZE(layers, rows, cols)                                      \
+	(sizeof(struct qmk_keymap_dump) - sizeof(struct qmk_keymap_header) +   \
+	 QMK_KEYMAP_SIZE(layers, rows, cols))
+
+#endif /* _QMK_KEYMAP_H */
@@ -7,6 +7,19 @@
 #define ACTIVE_LAYER 0x05
 #define LAYER_STATE 0x06
 #define USB_PASSTHROUGH 0x07
+#define SCAN_OVERRUN 0x08
+/*
+ * Sent by the kernel after every profile switch. Sent to the kernel, with
+ * the profile as the second byte, switches every keyboard to that profile.
+ * Only senders with CAP_SYS_ADMIN are obeyed.
+ */
+#define ACTIVE_PROFILE 0x09
+/*
+ * Sent to the kernel to ask for a struct qmk_keymap_dump of every keyboard.
+ * Each one comes back on its own, as 0, KEYMAP_DUMP and the dump: the 0
+ * stands for the one byte length of the usual messages, too short here.
+ */
+#define KEYMAP_DUMP 0x0A
 
 /* Protocol family, consistent in both kernel prog and user prog. */
 #define MYPROTO NETLINK_USERSOCK
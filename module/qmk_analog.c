@@ -0,0 +1,371 @@
+/*
+ * Analog (Hall-effect) key sensing through IIO
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/err.h>
+#include <linux/iio/consumer.h>
+#include <linux/iio/iio.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <asm/byteorder.h>
+
+#if IS_ENABLED(CONFIG_IIO_BUFFER_CB)
+
+/* longest wait for a capture of a strobed column */
+#define QMK_ANALOG_TIMEOUT_MS 10
+
+/*
+ * Readings are expected to grow as a key travels down. Each key is pressed
+ * once it reaches its actuation point and released once it comes back to
+ * its release point. With rapid trigger, a pressed key is also released as
+ * soon as it rises by the rapid trigger distance from its deepest point,
+ * and pressed again as soon as it falls by that distance from its highest
+ * point, without first having to return above the release point.
+ *
+ * The ADC runs buffered from its own trigger while the device is open, and
+ * hands every capture of all rows to qmk_analog_capture(). A strobed column
+ * waits for the first capture completed after its settle delay, so a
+ * column costs one conversion of every row instead of a read per row.
+ */
+
+/**
+ * struct qmk_analog - analog sensing state of one keyboard
+ * @buffer: callback buffer the captures arrive through
+ * @channels: ADC channel of each row
+ * @rows: number of channels
+ * @offset: per row offset of its reading in a capture
+ * @lock: guards @sample and @seq
+ * @wait: woken on every capture
+ * @seq: number of captures so far
+ * @sample: readings of the last capture
+ * @values: readings the scan works from
+ * @extreme: per key deepest reading while pressed, highest while released
+ * @pressed: keys currently pressed
+ * @rapid: keys released by rapid trigger that have not yet gone back above
+ *  their release point, and so may re-actuate early
+ */
+struct qmk_analog {
+	struct iio_cb_buffer *buffer;
+	struct iio_channel *channels;
+	unsigned int rows;
+	unsigned int *offset;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	unsigned long seq;
+	int *sample;
+	int *values;
+	int *extreme;
+	unsigned long *pressed;
+	unsigned long *rapid;
+};
+
+static int qmk_analog_value(const struct iio_chan_spec *chan, const void *data)
+{
+	const struct iio_scan_type *type = &chan->scan_type;
+	u32 raw;
+
+	switch (type->storagebits) {
+	case 8:
+		raw = *(const u8 *)data;
+		break;
+	case 16:
+		if (type->endianness == IIO_BE)
+			raw = be16_to_cpup(data);
+		else if (type->endianness == IIO_LE)
+			raw = le16_to_cpup(data);
+		else
+			raw = *(const u16 *)data;
+		break;
+	default:
+		if (type->endianness == IIO_BE)
+			raw = be32_to_cpup(data);
+		else if (type->endianness == IIO_LE)
+			raw = le32_to_cpup(data);
+		else
+			raw = *(const u32 *)data;
+		break;
+	}
+
+	raw >>= type->shift;
+	if (type->sign == 's')
+		return sign_extend32(raw, type->realbits - 1);
+
+	return raw & GENMASK(type->realbits - 1, 0);
+}
+
+/* called from the ADC's trigger handler with one capture of every row */
+static int qmk_analog_capture(const void *data, void *private)
+{
+	struct qmk_analog *analog = private;
+	unsigned long flags;
+	unsigned int row;
+
+	spin_lock_irqsave(&analog->lock, flags);
+	for (row = 0; row < analog->rows; row++)
+		analog->sample[row] =
+			qmk_analog_value(analog->channels[row].channel,
+					 data + analog->offset[row]);
+	analog->seq++;
+	spin_unlock_irqrestore(&analog->lock, flags);
+
+	wake_up(&analog->wait);
+
+	return 0;
+}
+
+/*
+ * A capture holds the channels in scan index order, each aligned to its
+ * own size, whatever order io-channels lists them in.
+ */
+static int qmk_analog_layout(struct qmk_module *module,
+			     struct qmk_analog *analog)
+{
+	const struct iio_chan_spec *chan;
+	unsigned int row, n, next, bytes, offset = 0;
+	int last = -1;
+
+	for (row = 0; row < analog->rows; row++) {
+		chan = analog->channels[row].channel;
+		bytes = chan->scan_type.storagebits / 8;
+		if (bytes != 1 && bytes != 2 && bytes != 4) {
+			dev_err(module->dev, "unsupported ADC sample size %u\n",
+				chan->scan_type.storagebits);
+			return -EINVAL;
+		}
+	}
+
+	for (n = 0; n < analog->rows; n++) {
+		/* the row with the lowest scan index not placed yet */
+		next = analog->rows;
+		for (row = 0; row < analog->rows; row++) {
+			chan = analog->channels[row].channel;
+			if (chan->scan_index > last &&
+			    (next == analog->rows ||
+			     chan->scan_index <
+				     analog->channels[next].channel->scan_index))
+				next = row;
+		}
+
+		chan = analog->channels[next].channel;
+		bytes = chan->scan_type.storagebits / 8;
+		offset = ALIGN(offset, bytes);
+		analog->offset[next] = offset;
+		offset += bytes;
+		last = chan->scan_index;
+	}
+
+	return 0;
+}
+
+static void qmk_analog_update(struct qmk_module *module, unsigned int key,
+			      int value)
+{
+	const struct qmk_platform_data *pdata = module->pdata;
+	struct qmk_analog *analog = module->analog;
+	int rapid = pdata->analog_rapid_trigger;
+	int actuation = pdata->analog_actuation[key];
+	int release = pdata->analog_release[key];
+	int *extreme = &analog->extreme[key];
+
+	if (test_bit(key, analog->pressed)) {
+		if (value <= release) {
+			__clear_bit(key, analog->pressed);
+			__clear_bit(key, analog->rapid);
+			*extreme = value;
+		} else if (rapid && value <= *extreme - rapid) {
+			__clear_bit(key, analog->pressed);
+			__set_bit(key, analog->rapid);
+			*extreme = value;
+		} else {
+			*extreme = max(*extreme, value);
+		}
+		return;
+	}
+
+	if (value >= actuation ||
+	    (test_bit(key, analog->rapid) && value >= *extreme + rapid)) {
+		__set_bit(key, analog->pressed);
+		*extreme = value;
+		return;
+	}
+
+	if (value <= release)
+		__clear_bit(key, analog->rapid);
+	*extreme = min(*extreme, value);
+}
+
+/*
+ * Called for every column while it is strobed, sets the digital state of
+ * its keys in current_key_state for the usual analysis. A column whose
+ * capture doesn't come in time keeps the state it had.
+ */
+void qmk_analog_read(struct qmk_module *module, unsigned int col)
+{
+	struct qmk_analog *analog = module->analog;
+	unsigned int cols = module->keyboard->cols;
+	unsigned long seq = READ_ONCE(analog->seq);
+	unsigned long flags;
+	unsigned int row, key;
+	bool fresh;
+
+	fresh = wait_event_timeout(analog->wait, READ_ONCE(analog->seq) != seq,
+				   msecs_to_jiffies(QMK_ANALOG_TIMEOUT_MS));
+	if (fresh) {
+		spin_lock_irqsave(&analog->lock, flags);
+		memcpy(analog->values, analog->sample,
+		       analog->rows * sizeof(*analog->values));
+		spin_unlock_irqrestore(&analog->lock, flags);
+	} else {
+		dev_dbg_ratelimited(module->dev, "no ADC capture for column %u\n",
+				    col);
+	}
+
+	for (row = 0; row < analog->rows; row++) {
+		key = row * cols + col;
+
+		if (fresh)
+			qmk_analog_update(module, key, analog->values[row]);
+
+		if (test_bit(key, analog->pressed))
+			__set_bit((col << module->col_shift) + row,
+				  module->current_key_state);
+	}
+}
+
+void qmk_analog_start(struct qmk_module *module)
+{
+	int err;
+
+	if (!module->analog)
+		return;
+
+	err = iio_channel_start_all_cb(module->analog->buffer);
+	if (err)
+		dev_err(module->dev, "unable to start ADC captures, err=%d\n",
+			err);
+}
+
+void qmk_analog_stop(struct qmk_module *module)
+{
+	if (module->analog)
+		iio_channel_stop_all_cb(module->analog->buffer);
+}
+
+static void qmk_analog_release(void *data)
+{
+	iio_channel_release_all_cb(data);
+}
+
+int qmk_analog_init(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int keys = keyboard->rows * keyboard->cols;
+	struct qmk_analog *analog;
+	struct iio_cb_buffer *buffer;
+	unsigned int rows = 0;
+	int err;
+
+	if (!module->pdata->analog)
+		return 0;
+
+	analog = devm_kzalloc(module->dev, sizeof(*analog), GFP_KERNEL);
+	if (!analog)
+		return -ENOMEM;
+
+	spin_lock_init(&analog->lock);
+	init_waitqueue_head(&analog->wait);
+
+	buffer = iio_channel_get_all_cb(module->dev, qmk_analog_capture,
+					analog);
+	if (IS_ERR(buffer)) {
+		if (PTR_ERR(buffer) != -EPROBE_DEFER)
+			dev_err(module->dev, "unable to get ADC channels\n");
+		return PTR_ERR(buffer);
+	}
+
+	err = devm_add_action_or_reset(module->dev, qmk_analog_release,
+				       buffer);
+	if (err)
+		return err;
+
+	analog->buffer = buffer;
+	analog->channels = iio_channel_cb_get_channels(buffer);
+
+	while (analog->channels[rows].indio_dev)
+		rows++;
+
+	if (rows != keyboard->rows) {
+		dev_err(module->dev, "expected %u ADC channels, got %u\n",
+			keyboard->rows, rows);
+		return -EINVAL;
+	}
+	analog->rows = rows;
+
+	analog->offset = devm_kcalloc(module->dev, rows, sizeof(unsigned int),
+				      GFP_KERNEL);
+	analog->sample = devm_kcalloc(module->dev, rows, sizeof(int),
+				      GFP_KERNEL);
+	analog->values = devm_kcalloc(module->dev, rows, sizeof(int),
+				      GFP_KERNEL);
+	analog->extreme = devm_kcalloc(module->dev, keys, sizeof(int),
+				       GFP_KERNEL);
+	analog->pressed = devm_kcalloc(module->dev, BITS_TO_LONGS(keys),
+				       sizeof(unsigned long), GFP_KERNEL);
+	analog->rapid = devm_kcalloc(module->dev, BITS_TO_LONGS(keys),
+				     sizeof(unsigned long), GFP_KERNEL);
+	if (!analog->offset || !analog->sample || !analog->values ||
+	    !analog->extreme || !analog->pressed || !analog->rapid)
+		return -ENOMEM;
+
+	err = qmk_analog_layout(module, analog);
+	if (err)
+		return err;
+
+	module->analog = analog;
+
+	return 0;
+}
+
+#else
+
+int qmk_analog_init(struct qmk_module *module)
+{
+	if (!module->pdata->analog)
+		return 0;
+
+	dev_err(module->dev, "analog rows need IIO callback buffers\n");
+	return -ENODEV;
+}
+
+void qmk_analog_read(struct qmk_module *module, unsigned int col)
+{
+}
+
+void qmk_analog_start(struct qmk_module *module)
+{
+}
+
+void qmk_analog_stop(struct qmk_module *module)
+{
+}
+
+#endif
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,392 @@
+/*
+ * Capture and replay of raw matrix scans through debugfs
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_capture.h"
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+#define QMK_CAPTURE_FIFO_SIZE (64 * 1024)
+
+#define QMK_CAPTURE_OPEN 0
+#define QMK_REPLAY_OPEN 1
+
+/**
+ * struct qmk_capture - capture/replay state of one keyboard
+ * @module: owning module
+ * @fifo: records waiting to be read from the capture file
+ * @wait: readers waiting for records
+ * @header: header describing this keyboard's records
+ * @flags: QMK_CAPTURE_OPEN/QMK_REPLAY_OPEN, each file has a single user
+ * @capturing: records are pushed from the scan path
+ * @capture_started: header was read from the capture file
+ * @replay_started: header was written to the replay file
+ * @replay_ns: time of the record being replayed, advanced by the recorded
+ *  deltas
+ * @last_ns: time of the previous record
+ * @dropped: records lost because the reader fell behind
+ * @record: matrix words of the record being captured
+ * @capture_file: debugfs entry of the capture file
+ * @replay_file: debugfs entry of the replay file
+ */
+struct qmk_capture {
+	struct qmk_module *module;
+	struct kfifo fifo;
+	wait_queue_head_t wait;
+	struct qmk_capture_header header;
+	unsigned long flags;
+	bool capturing;
+	bool capture_started;
+	bool replay_started;
+	u64 replay_ns;
+	u64 last_ns;
+	u32 dropped;
+	u32 *record;
+	struct dentry *capture_file;
+	struct dentry *replay_file;
+};
+
+/*
+ * Records store each column as DIV_ROUND_UP(rows, 32) words regardless of
+ * the kernel's word size, so captures can be replayed on any machine.
+ */
+static unsigned int qmk_capture_col_words(struct qmk_module *module)
+{
+	return DIV_ROUND_UP(module->keyboard->rows, 32);
+}
+
+static void qmk_capture_pack(struct qmk_module *module, u32 *words)
+{
+	unsigned int col_words = qmk_capture_col_words(module);
+	unsigned int col;
+
+	for (col = 0; col < module->keyboard->cols; col++)
+		bitmap_to_arr32(words + col * col_words,
+				module->current_key_state +
+					BIT_WORD(col << module->col_shift),
+				module->keyboard->rows);
+}
+
+static void qmk_capture_unpack(struct qmk_module *module, const u32 *words)
+{
+	unsigned int col_words = qmk_capture_col_words(module);
+	unsigned int col;
+
+	bitmap_zero(module->current_key_state, module->matrix_bits);
+	for (col = 0; col < module->keyboard->cols; col++)
+		bitmap_from_arr32(module->current_key_state +
+					  BIT_WORD(col << module->col_shift),
+				  words + col * col_words,
+				  module->keyboard->rows);
+}
+
+/*
+ * Called from the scan path with scan_lock held and the freshly read
+ * matrix, before it is analyzed. The fifo has a single producer and a
+ * single consumer, so no locking is needed beyond that.
+ */
+void qmk_capture_scan(struct qmk_module *module)
+{
+	struct qmk_capture *capture = module->capture;
+	size_t size = QMK_CAPTURE_RECORD_SIZE(capture->header.words);
+	u64 now;
+	u32 delta_us;
+
+	if (!READ_ONCE(capture->capturing))
+		return;
+
+	if (kfifo_avail(&capture->fifo) < size) {
+		capture->dropped++;
+		return;
+	}
+
+	now = ktime_get_ns();
+	delta_us = min_t(u64, div_u64(now - capture->last_ns, NSEC_PER_USEC),
+			 U32_MAX);
+	capture->last_ns = now;
+
+	kfifo_in(&capture->fifo, &delta_us, sizeof(delta_us));
+	qmk_capture_pack(module, capture->record);
+	kfifo_in(&capture->fifo, capture->record, size - sizeof(delta_us));
+
+	wake_up_interruptible(&capture->wait);
+}
+
+static int qmk_capture_open(struct inode *inode, struct file *file)
+{
+	struct qmk_capture *capture = inode->i_private;
+	struct qmk_module *module = capture->module;
+
+	if (test_and_set_bit(QMK_CAPTURE_OPEN, &capture->flags))
+		return -EBUSY;
+
+	file->private_data = capture;
+
+	/*
+	 * A scan that saw capturing before the last release may still be
+	 * pushing, so the fifo is only reset with the producer held off.
+	 */
+	mutex_lock(&module->scan_lock);
+	kfifo_reset(&capture->fifo);
+	capture->capture_started = false;
+	capture->dropped = 0;
+	capture->last_ns = ktime_get_ns();
+	WRITE_ONCE(capture->capturing, true);
+	mutex_unlock(&module->scan_lock);
+
+	return nonseekable_open(inode, file);
+}
+
+static int qmk_capture_release(struct inode *inode, struct file *file)
+{
+	struct qmk_capture *capture = file->private_data;
+
+	WRITE_ONCE(capture->capturing, false);
+	if (capture->dropped)
+		dev_warn(capture->module->dev,
+			 "capture dropped %u records\n", capture->dropped);
+	clear_bit(QMK_CAPTURE_OPEN, &capture->flags);
+
+	return 0;
+}
+
+static ssize_t qmk_capture_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct qmk_capture *capture = file->private_data;
+	unsigned int copied;
+	int err;
+
+	if (!capture->capture_started) {
+		if (count < sizeof(capture->header))
+			return -EINVAL;
+		if (copy_to_user(buf, &capture->header,
+				 sizeof(capture->header)))
+			return -EFAULT;
+		capture->capture_started = true;
+		return sizeof(capture->header);
+	}
+
+	if (kfifo_is_empty(&capture->fifo)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		err = wait_event_interruptible(capture->wait,
+					       !kfifo_is_empty(&capture->fifo));
+		if (err)
+			return err;
+	}
+
+	err = kfifo_to_user(&capture->fifo, buf, count, &copied);
+
+	return err ? err : copied;
+}
+
+static __poll_t qmk_capture_poll(struct file *file, poll_table *wait)
+{
+	struct qmk_capture *capture = file->private_data;
+
+	poll_wait(file, &capture->wait, wait);
+
+	if (!capture->capture_started || !kfifo_is_empty(&capture->fifo))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations qmk_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = qmk_capture_open,
+	.release = qmk_capture_release,
+	.read = qmk_capture_read,
+	.poll = qmk_capture_poll,
+	.llseek = no_llseek,
+};
+
+static int qmk_replay_open(struct inode *inode, struct file *file)
+{
+	struct qmk_capture *capture = inode->i_private;
+	struct qmk_module *module = capture->module;
+	struct qmk_debounce *debounce;
+
+	if (test_and_set_bit(QMK_REPLAY_OPEN, &capture->flags))
+		return -EBUSY;
+
+	file->private_data = capture;
+
+	/* the live scan stands aside while a replay is fed in */
+	mutex_lock(&module->scan_lock);
+	debounce = qmk_debounce_replay(module);
+	if (debounce) {
+		module->replay_debounce = debounce;
+		module->replaying = true;
+	}
+	mutex_unlock(&module->scan_lock);
+
+	if (!debounce) {
+		clear_bit(QMK_REPLAY_OPEN, &capture->flags);
+		return -ENOMEM;
+	}
+
+	return nonseekable_open(inode, file);
+}
+
+static int qmk_replay_release(struct inode *inode, struct file *file)
+{
+	struct qmk_capture *capture = file->private_data;
+	struct qmk_module *module = capture->module;
+
+	mutex_lock(&module->scan_lock);
+	module->replaying = false;
+	qmk_debounce_free(module->replay_debounce);
+	module->replay_debounce = NULL;
+	mutex_unlock(&module->scan_lock);
+
+	/* the replay header has to be sent again on the next open */
+	capture->replay_started = false;
+	clear_bit(QMK_REPLAY_OPEN, &capture->flags);
+
+	return 0;
+}
+
+/*
+ * Every write has to hold whole records (the first one prefixed by the
+ * header); pacing is left to the writer so replays can run at original or
+ * accelerated speed.
+ */
+static ssize_t qmk_replay_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct qmk_capture *capture = file->private_data;
+	struct qmk_module *module = capture->module;
+	size_t size = QMK_CAPTURE_RECORD_SIZE(capture->header.words);
+	size_t done = 0;
+	u32 *record;
+
+	if (!capture->replay_started) {
+		struct qmk_capture_header header;
+
+		if (count < sizeof(header))
+			return -EINVAL;
+		if (copy_from_user(&header, buf, sizeof(header)))
+			return -EFAULT;
+		if (header.magic != QMK_CAPTURE_MAGIC ||
+		    header.version != QMK_CAPTURE_VERSION ||
+		    header.words != capture->header.words ||
+		    header.rows != capture->header.rows ||
+		    header.cols != capture->header.cols) {
+			dev_err(module->dev, "replay does not match matrix\n");
+			return -EINVAL;
+		}
+
+		capture->replay_started = true;
+		capture->replay_ns = ktime_get_ns();
+		done = sizeof(header);
+	}
+
+	if ((count - done) % size)
+		return -EINVAL;
+
+	record = kmalloc(size, GFP_KERNEL);
+	if (!record)
+		return -ENOMEM;
+
+	while (done < count) {
+		if (copy_from_user(record, buf + done, size)) {
+			kfree(record);
+			return done ? done : -EFAULT;
+		}
+
+		/* debounce runs on the recorded time, however fast this is fed */
+		capture->replay_ns += (u64)record[0] * NSEC_PER_USEC;
+
+		mutex_lock(&module->scan_lock);
+		qmk_capture_unpack(module, &record[1]);
+		qmk_analyze_state(module, capture->replay_ns);
+		mutex_unlock(&module->scan_lock);
+
+		done += size;
+	}
+
+	kfree(record);
+
+	return count;
+}
+
+static const struct file_operations qmk_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = qmk_replay_open,
+	.release = qmk_replay_release,
+	.write = qmk_replay_write,
+	.llseek = no_llseek,
+};
+
+int qmk_capture_init(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct qmk_capture *capture;
+	unsigned int words;
+	int err;
+
+	capture = devm_kzalloc(module->dev, sizeof(*capture), GFP_KERNEL);
+	if (!capture)
+		return -ENOMEM;
+
+	words = keyboard->cols * qmk_capture_col_words(module);
+	capture->record =
+		devm_kcalloc(module->dev, words, sizeof(u32), GFP_KERNEL);
+	if (!capture->record)
+		return -ENOMEM;
+
+	err = kfifo_alloc(&capture->fifo, QMK_CAPTURE_FIFO_SIZE, GFP_KERNEL);
+	if (err)
+		return err;
+
+	init_waitqueue_head(&capture->wait);
+	capture->module = module;
+	capture->header.magic = QMK_CAPTURE_MAGIC;
+	capture->header.version = QMK_CAPTURE_VERSION;
+	capture->header.words = words;
+	capture->header.rows = keyboard->rows;
+	capture->header.cols = keyboard->cols;
+	module->capture = capture;
+
+	capture->capture_file = debugfs_create_file(
+		"capture", 0400, module->debugfs, capture, &qmk_capture_fops);
+	capture->replay_file = debugfs_create_file(
+		"replay", 0200, module->debugfs, capture, &qmk_replay_fops);
+
+	return 0;
+}
+
+void qmk_capture_exit(struct qmk_module *module)
+{
+	struct qmk_capture *capture = module->capture;
+
+	debugfs_remove(capture->capture_file);
+	debugfs_remove(capture->replay_file);
+	kfifo_free(&capture->fifo);
+}
+
+MODULE_LICENSE("GPL");
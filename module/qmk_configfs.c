@@ -0,0 +1,476 @@
+/*
+ * Keyboards defined at runtime through configfs
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_keymap.h"
+#include <linux/configfs.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+
+/*
+ * Every directory made under /sys/kernel/config/qmk is a keyboard. Its
+ * attributes fill in the platform data a device tree overlay would give,
+ * and writing 1 to enable registers a "qmk" platform device with it, which
+ * binds to this driver like any other. The settings can't change while it
+ * is enabled; writing 0 to enable or removing the directory takes the
+ * keyboard away again.
+ */
+
+#define QMK_BOARD_NAME_MAX 32
+
+/**
+ * struct qmk_board - keyboard defined through configfs
+ * @group: the board's directory
+ * @lock: guards everything below against enable
+ * @pdev: the registered device, NULL while disabled
+ * @name: input device name, the directory name when empty
+ * @row_gpios: gpio of each row
+ * @col_gpios: gpio of each column
+ * @keymap: binary keymap in the format keymap_bin takes
+ * @keymap_size: size of @keymap
+ */
+struct qmk_board {
+	struct config_group group;
+	struct mutex lock;
+	struct platform_device *pdev;
+
+	char name[QMK_BOARD_NAME_MAX];
+	unsigned int layers;
+	unsigned int rows;
+	unsigned int cols;
+	unsigned int row_gpios[MATRIX_MAX_ROWS];
+	unsigned int col_gpios[MATRIX_MAX_COLS];
+	unsigned int poll_interval;
+	unsigned int col_scan_delay_us;
+	unsigned int debounce_delay_ms;
+	unsigned int active_low;
+	unsigned int drive_inactive_cols;
+	unsigned int no_autorepeat;
+	void *keymap;
+	size_t keymap_size;
+};
+
+static inline struct qmk_board *to_qmk_board(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct qmk_board, group);
+}
+
+static int qmk_board_enable(struct qmk_board *board)
+{
+	struct qmk_platform_data pdata = { 0 };
+	struct platform_device *pdev;
+	bool bound;
+
+	if (!board->rows || !board->cols || !board->keymap)
+		return -EINVAL;
+
+	pdata.name = board->name[0] ? board->name :
+				      config_item_name(&board->group.cg_item);
+	pdata.row_gpios = board->row_gpios;
+	pdata.col_gpios = board->col_gpios;
+	pdata.num_layers = board->layers;
+	pdata.num_row_gpios = board->rows;
+	pdata.num_col_gpios = board->cols;
+	pdata.poll_interval = board->poll_interval;
+	pdata.col_scan_delay_us = board->col_scan_delay_us;
+	pdata.debounce_ms = board->debounce_delay_ms;
+	pdata.debounce_max_us = QMK_DEBOUNCE_MAX_US_DEFAULT;
+	pdata.active_low = board->active_low;
+	pdata.drive_inactive_cols = board->drive_inactive_cols;
+	pdata.no_autorepeat = board->no_autorepeat;
+	pdata.scan_priority = QMK_SCAN_PRIORITY_DEFAULT;
+	cpumask_copy(&pdata.scan_cpus, cpu_possible_mask);
+	pdata.idle_scans = QMK_IDLE_SCANS_DEFAULT;
+	pdata.stuck_ms = QMK_STUCK_MS_DEFAULT;
+	pdata.keymap_bin = board->keymap;
+	pdata.keymap_bin_size = board->keymap_size;
+
+	/* the pointers in pdata stay valid, nothing changes until disabled */
+	pdev = platform_device_register_data(NULL, "qmk", PLATFORM_DEVID_AUTO,
+					     &pdata, sizeof(pdata));
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	/* probe runs on registration, a failed one is reported here */
+	device_lock(&pdev->dev);
+	bound = pdev->dev.driver;
+	device_unlock(&pdev->dev);
+	if (!bound) {
+		platform_device_unregister(pdev);
+		return -ENODEV;
+	}
+
+	board->pdev = pdev;
+
+	return 0;
+}
+
+static void qmk_board_disable(struct qmk_board *board)
+{
+	if (!board->pdev)
+		return;
+
+	platform_device_unregister(board->pdev);
+	board->pdev = NULL;
+}
+
+#define QMK_BOARD_ATTR(_name, _min, _max)                                      \
+	static ssize_t qmk_board_##_name##_show(struct config_item *item,      \
+						char *page)                    \
+	{                                                                      \
+		return sprintf(page, "%u\n", to_qmk_board(item)->_name);       \
+	}                                                                      \
+                                                                               \
+	static ssize_t qmk_board_##_name##_store(struct config_item *item,     \
+						 const char *page,             \
+						 size_t count)                 \
+	{                                                                      \
+		struct qmk_board *board = to_qmk_board(item);                  \
+		unsigned int val;                                              \
+		int err;                                                       \
+                                                                               \
+		err = kstrtouint(page, 0, &val);                               \
+		if (err)                                                       \
+			return err;                                            \
+		if (val < (_min) || val > (_max))                              \
+			return -EINVAL;                                        \
+                                                                               \
+		mutex_lock(&board->lock);                                      \
+		if (board->pdev)                                               \
+			err = -EBUSY;                                          \
+		else                                                           \
+			board->_name = val;                                    \
+		mutex_unlock(&board->lock);                                    \
+                                                                               \
+		return err ?: count;                                           \
+	}                                                                      \
+                                                                               \
+	CONFIGFS_ATTR(qmk_board_, _name)
+
+QMK_BOARD_ATTR(layers, 1, MATRIX_MAX_LAYERS);
+QMK_BOARD_ATTR(poll_interval, QMK_POLL_INTERVAL_MIN, UINT_MAX);
+QMK_BOARD_ATTR(col_scan_delay_us, 0, QMK_COL_SCAN_DELAY_MAX_US);
+QMK_BOARD_ATTR(debounce_delay_ms, 0, QMK_DEBOUNCE_MAX_MS);
+QMK_BOARD_ATTR(active_low, 0, 1);
+QMK_BOARD_ATTR(drive_inactive_cols, 0, 1);
+QMK_BOARD_ATTR(no_autorepeat, 0, 1);
+
+static ssize_t qmk_board_gpios_show(const unsigned int *gpios,
+				    unsigned int count, char *page)
+{
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		len += sprintf(page + len, "%s%u", i ? "," : "", gpios[i]);
+	len += sprintf(page + len, "\n");
+
+	return len;
+}
+
+/* gpio numbers separated by commas, as in "17,27,22" or "5-12" */
+static ssize_t qmk_board_gpios_store(struct qmk_board *board,
+				     unsigned int *gpios, unsigned int *count,
+				     unsigned int max, const char *page,
+				     size_t len)
+{
+	/* the count, up to the most gpios a side can have, and one too many */
+	int ints[MATRIX_MAX_ROWS + 2];
+	int err = 0;
+	int i;
+
+	BUILD_BUG_ON(MATRIX_MAX_ROWS != MATRIX_MAX_COLS);
+
+	/* get_options() stops quietly when ints[] is full, dropping the rest */
+	get_options(page, ARRAY_SIZE(ints), ints);
+	if (ints[0] <= 0 || ints[0] >= (int)ARRAY_SIZE(ints) - 1 ||
+	    ints[0] > max)
+		return -EINVAL;
+	for (i = 1; i <= ints[0]; i++)
+		if (ints[i] < 0)
+			return -EINVAL;
+
+	mutex_lock(&board->lock);
+	if (board->pdev) {
+		err = -EBUSY;
+	} else {
+		for (i = 0; i < ints[0]; i++)
+			gpios[i] = ints[i + 1];
+		*count = ints[0];
+	}
+	mutex_unlock(&board->lock);
+
+	return err ?: len;
+}
+
+static ssize_t qmk_board_row_gpios_show(struct config_item *item, char *page)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	return qmk_board_gpios_show(board->row_gpios, board->rows, page);
+}
+
+static ssize_t qmk_board_row_gpios_store(struct config_item *item,
+					 const char *page, size_t count)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	return qmk_board_gpios_store(board, board->row_gpios, &board->rows,
+				     MATRIX_MAX_ROWS, page, count);
+}
+
+CONFIGFS_ATTR(qmk_board_, row_gpios);
+
+static ssize_t qmk_board_col_gpios_show(struct config_item *item, char *page)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	return qmk_board_gpios_show(board->col_gpios, board->cols, page);
+}
+
+static ssize_t qmk_board_col_gpios_store(struct config_item *item,
+					 const char *page, size_t count)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	return qmk_board_gpios_store(board, board->col_gpios, &board->cols,
+				     MATRIX_MAX_COLS, page, count);
+}
+
+CONFIGFS_ATTR(qmk_board_, col_gpios);
+
+static ssize_t qmk_board_name_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%s\n", to_qmk_board(item)->name);
+}
+
+static ssize_t qmk_board_name_store(struct config_item *item,
+				    const char *page, size_t count)
+{
+	struct qmk_board *board = to_qmk_board(item);
+	int err = 0;
+
+	mutex_lock(&board->lock);
+	if (board->pdev) {
+		err = -EBUSY;
+	} else {
+		strlcpy(board->name, page, sizeof(board->name));
+		strim(board->name);
+	}
+	mutex_unlock(&board->lock);
+
+	return err ?: count;
+}
+
+CONFIGFS_ATTR(qmk_board_, name);
+
+static ssize_t qmk_board_enable_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%d\n", !!to_qmk_board(item)->pdev);
+}
+
+static ssize_t qmk_board_enable_store(struct config_item *item,
+				      const char *page, size_t count)
+{
+	struct qmk_board *board = to_qmk_board(item);
+	bool enable;
+	int err;
+
+	err = kstrtobool(page, &enable);
+	if (err)
+		return err;
+
+	mutex_lock(&board->lock);
+	if (enable && !board->pdev)
+		err = qmk_board_enable(board);
+	else if (!enable)
+		qmk_board_disable(board);
+	mutex_unlock(&board->lock);
+
+	return err ?: count;
+}
+
+CONFIGFS_ATTR(qmk_board_, enable);
+
+static ssize_t qmk_board_keymap_read(struct config_item *item, void *buf,
+				     size_t size)
+{
+	struct qmk_board *board = to_qmk_board(item);
+	ssize_t len;
+
+	mutex_lock(&board->lock);
+	len = board->keymap_size;
+	if (buf && board->keymap)
+		memcpy(buf, board->keymap, min(size, board->keymap_size));
+	mutex_unlock(&board->lock);
+
+	return len;
+}
+
+/* the keymap is only checked against the matrix once enabled */
+static ssize_t qmk_board_keymap_write(struct config_item *item,
+				      const void *buf, size_t size)
+{
+	struct qmk_board *board = to_qmk_board(item);
+	void *keymap;
+	int err = 0;
+
+	if (size < sizeof(struct qmk_keymap_header))
+		return -EINVAL;
+
+	keymap = kvmalloc(size, GFP_KERNEL);
+	if (!keymap)
+		return -ENOMEM;
+	memcpy(keymap, buf, size);
+
+	mutex_lock(&board->lock);
+	if (board->pdev) {
+		err = -EBUSY;
+	} else {
+		swap(board->keymap, keymap);
+		board->keymap_size = size;
+	}
+	mutex_unlock(&board->lock);
+
+	kvfree(keymap);
+
+	return err ?: size;
+}
+
+CONFIGFS_BIN_ATTR(qmk_board_, keymap, NULL,
+		  QMK_KEYMAP_SIZE(MATRIX_MAX_LAYERS, MATRIX_MAX_ROWS,
+				  MATRIX_MAX_COLS));
+
+static struct configfs_attribute *qmk_board_attrs[] = {
+	&qmk_board_attr_name,
+	&qmk_board_attr_layers,
+	&qmk_board_attr_row_gpios,
+	&qmk_board_attr_col_gpios,
+	&qmk_board_attr_poll_interval,
+	&qmk_board_attr_col_scan_delay_us,
+	&qmk_board_attr_debounce_delay_ms,
+	&qmk_board_attr_active_low,
+	&qmk_board_attr_drive_inactive_cols,
+	&qmk_board_attr_no_autorepeat,
+	&qmk_board_attr_enable,
+	NULL,
+};
+
+static struct configfs_bin_attribute *qmk_board_bin_attrs[] = {
+	&qmk_board_attr_keymap,
+	NULL,
+};
+
+static void qmk_board_release(struct config_item *item)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	kvfree(board->keymap);
+	kfree(board);
+}
+
+static struct configfs_item_operations qmk_board_item_ops = {
+	.release = qmk_board_release,
+};
+
+static const struct config_item_type qmk_board_type = {
+	.ct_item_ops = &qmk_board_item_ops,
+	.ct_attrs = qmk_board_attrs,
+	.ct_bin_attrs = qmk_board_bin_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_group *qmk_boards_make_group(struct config_group *group,
+						  const char *name)
+{
+	struct qmk_board *board;
+
+	board = kzalloc(sizeof(*board), GFP_KERNEL);
+	if (!board)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&board->lock);
+	board->layers = 1;
+	board->poll_interval = QMK_POLL_INTERVAL_DEFAULT;
+	config_group_init_type_name(&board->group, name, &qmk_board_type);
+
+	return &board->group;
+}
+
+static void qmk_boards_drop_item(struct config_group *group,
+				 struct config_item *item)
+{
+	struct qmk_board *board = to_qmk_board(item);
+
+	mutex_lock(&board->lock);
+	qmk_board_disable(board);
+	mutex_unlock(&board->lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations qmk_boards_group_ops = {
+	.make_group = qmk_boards_make_group,
+	.drop_item = qmk_boards_drop_item,
+};
+
+static const struct config_item_type qmk_boards_type = {
+	.ct_group_ops = &qmk_boards_group_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem qmk_configfs = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = "qmk",
+			.ci_type = &qmk_boards_type,
+		},
+	},
+};
+
+int qmk_configfs_init(void)
+{
+	config_group_init(&qmk_configfs.su_group);
+	mutex_init(&qmk_configfs.su_mutex);
+
+	return configfs_register_subsystem(&qmk_configfs);
+}
+
+void qmk_configfs_exit(void)
+{
+	configfs_unregister_subsystem(&qmk_configfs);
+}
+
+#else
+
+int qmk_configfs_init(void)
+{
+	return 0;
+}
+
+void qmk_configfs_exit(void)
+{
+}
+
+#endif
+
+MODULE_LICENSE("GPL");
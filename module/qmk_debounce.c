@@ -0,0 +1,316 @@
+/*
+ * Per-key debounce, fixed or adapted to each switch
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+/*
+ * Debounce is eager: a change is reported on the first scan that sees it,
+ * and any further change of that key within its window is held back as a
+ * bounce. In adaptive mode each key learns how long its switch bounces and
+ * its window shrinks to match, bounded by min_us and max_us.
+ *
+ * The state is always allocated so a fixed window can be set at runtime;
+ * with a zero window the scan skips debouncing altogether. Time comes from
+ * the caller: the scan start for live scans, the recorded deltas for
+ * replays, which also get a scratch state of their own so they neither
+ * depend on how fast they are fed nor change what the keys learned.
+ */
+
+/**
+ * struct qmk_debounce_key - debounce state of one key
+ * @changed_ns: time of the last reported change
+ * @bounce_ns: time of the last bounce held back after it
+ * @estimate_us: decaying estimate of how long this switch bounces
+ * @window_us: changes closer than this to the last one are bounces
+ */
+struct qmk_debounce_key {
+	u64 changed_ns;
+	u64 bounce_ns;
+	u32 estimate_us;
+	u32 window_us;
+};
+
+/**
+ * struct qmk_debounce - debounce state of one keyboard
+ * @raw: matrix as read by the previous scan, before debouncing
+ * @adaptive: learn each key's window instead of using a fixed one
+ * @fixed_us: window of every key when not adaptive
+ * @min_us: smallest window in adaptive mode
+ * @max_us: largest window in adaptive mode
+ * @due_ns: when the first change held back by the last call may be
+ *  reported, 0 if none was
+ * @key: per key state, row-major
+ */
+struct qmk_debounce {
+	unsigned long *raw;
+	bool adaptive;
+	u32 fixed_us;
+	u32 min_us;
+	u32 max_us;
+	u64 due_ns;
+	struct qmk_debounce_key key[];
+};
+
+static bool qmk_debounce_within(struct qmk_debounce_key *key, u64 now)
+{
+	return now - key->changed_ns < (u64)key->window_us * NSEC_PER_USEC;
+}
+
+/*
+ * Takes what the last change revealed about the switch: bounces held back
+ * after it, or the change now being reported coming so soon after it that
+ * it was most likely a bounce that outlasted the window. A longer bounce
+ * is adopted at once, a shorter one only pulls the estimate down by an
+ * eighth of the difference.
+ */
+static void qmk_debounce_learn(struct qmk_debounce *debounce,
+			       struct qmk_debounce_key *key, u64 now)
+{
+	u64 observed = 0;
+	u32 observed_us;
+
+	if (key->bounce_ns > key->changed_ns)
+		observed = key->bounce_ns - key->changed_ns;
+	if (now - key->changed_ns < (u64)debounce->max_us * NSEC_PER_USEC)
+		observed = now - key->changed_ns;
+	observed_us = div_u64(observed, NSEC_PER_USEC);
+
+	if (observed_us > key->estimate_us)
+		key->estimate_us = observed_us;
+	else
+		key->estimate_us -= (key->estimate_us - observed_us) / 8;
+
+	key->window_us = clamp(key->estimate_us + key->estimate_us / 2,
+			       debounce->min_us, debounce->max_us);
+}
+
+/* called from qmk_analyze_state() with scan_lock held */
+void qmk_debounce(struct qmk_module *module, struct qmk_debounce *debounce,
+		  u64 now)
+{
+	unsigned long *state = module->current_key_state;
+	unsigned long *scratch = module->changed_key_state;
+	unsigned int bits = module->matrix_bits;
+	unsigned int cols = module->keyboard->cols;
+	struct qmk_debounce_key *key;
+	unsigned int bit, row, col;
+	u64 due;
+
+	debounce->due_ns = 0;
+	if (!debounce->adaptive && !debounce->fixed_us)
+		return;
+
+	/* raw transitions inside a key's window are its bounces */
+	bitmap_xor(scratch, state, debounce->raw, bits);
+	bitmap_copy(debounce->raw, state, bits);
+	for_each_set_bit(bit, scratch, bits) {
+		col = bit >> module->col_shift;
+		row = bit & ((1 << module->col_shift) - 1);
+		key = &debounce->key[row * cols + col];
+
+		if (qmk_debounce_within(key, now)) {
+			key->bounce_ns = now;
+			qmk_health_bounce(module, row, col);
+		}
+	}
+
+	/* hold keys inside their window, accept the other changes */
+	bitmap_xor(scratch, state, module->last_key_state, bits);
+	for_each_set_bit(bit, scratch, bits) {
+		col = bit >> module->col_shift;
+		row = bit & ((1 << module->col_shift) - 1);
+		key = &debounce->key[row * cols + col];
+
+		if (qmk_debounce_within(key, now)) {
+			__change_bit(bit, state);
+			due = key->changed_ns +
+			      (u64)key->window_us * NSEC_PER_USEC;
+			if (!debounce->due_ns || due < debounce->due_ns)
+				debounce->due_ns = due;
+			continue;
+		}
+
+		if (debounce->adaptive)
+			qmk_debounce_learn(debounce, key, now);
+		key->changed_ns = now;
+	}
+}
+
+/*
+ * Called with scan_lock held. A held back change is only reported by a
+ * scan after its window, which keyboards that are not polled have to ask
+ * for.
+ */
+u64 qmk_debounce_due(struct qmk_debounce *debounce)
+{
+	return debounce->due_ns;
+}
+
+/* adaptive keys start at the safe end and learn their way down */
+static void qmk_debounce_reset(struct qmk_debounce *debounce,
+			       unsigned int keys)
+{
+	u32 window_us = debounce->adaptive ? debounce->max_us :
+					     debounce->fixed_us;
+	unsigned int i;
+
+	for (i = 0; i < keys; i++) {
+		debounce->key[i].estimate_us = window_us;
+		debounce->key[i].window_us = window_us;
+	}
+}
+
+/*
+ * Called with scan_lock held when debounce-delay-ms is changed at runtime,
+ * adaptive windows are left to keep learning
+ */
+void qmk_debounce_set(struct qmk_module *module, unsigned int debounce_ms)
+{
+	struct qmk_debounce *debounce = module->debounce;
+	struct qmk_keyboard *keyboard = module->keyboard;
+
+	if (debounce->adaptive)
+		return;
+
+	/* the raw state went stale while debouncing was off */
+	if (!debounce->fixed_us)
+		bitmap_copy(debounce->raw, module->last_key_state,
+			    module->matrix_bits);
+
+	debounce->fixed_us = debounce_ms * USEC_PER_MSEC;
+	qmk_debounce_reset(debounce, keyboard->rows * keyboard->cols);
+}
+
+static int qmk_debounce_show(struct seq_file *s, void *data)
+{
+	struct qmk_module *module = s->private;
+	struct qmk_debounce *debounce = module->debounce;
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct qmk_debounce_key *key;
+	unsigned int row, col;
+
+	seq_puts(s, "row col window_us estimate_us\n");
+
+	mutex_lock(&module->scan_lock);
+	for (row = 0; row < keyboard->rows; row++) {
+		for (col = 0; col < keyboard->cols; col++) {
+			key = &debounce->key[row * keyboard->cols + col];
+			seq_printf(s, "%3u %3u %9u %11u\n", row, col,
+				   key->window_us, key->estimate_us);
+		}
+	}
+	mutex_unlock(&module->scan_lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(qmk_debounce);
+
+static struct qmk_debounce *qmk_debounce_alloc(struct qmk_module *module)
+{
+	const struct qmk_platform_data *pdata = module->pdata;
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int keys = keyboard->rows * keyboard->cols;
+	struct qmk_debounce *debounce;
+
+	debounce = kzalloc(struct_size(debounce, key, keys), GFP_KERNEL);
+	if (!debounce)
+		return NULL;
+
+	debounce->raw = kcalloc(BITS_TO_LONGS(module->matrix_bits),
+				sizeof(unsigned long), GFP_KERNEL);
+	if (!debounce->raw) {
+		kfree(debounce);
+		return NULL;
+	}
+
+	debounce->adaptive = pdata->debounce_adaptive;
+	debounce->fixed_us = pdata->debounce_ms * USEC_PER_MSEC;
+	debounce->min_us = pdata->debounce_min_us;
+	debounce->max_us = max(pdata->debounce_max_us, debounce->min_us);
+	qmk_debounce_reset(debounce, keys);
+
+	return debounce;
+}
+
+void qmk_debounce_free(struct qmk_debounce *debounce)
+{
+	if (!debounce)
+		return;
+
+	kfree(debounce->raw);
+	kfree(debounce);
+}
+QMK_EXPORT_IF_KUNIT(qmk_debounce_free);
+
+static void qmk_debounce_release(void *data)
+{
+	qmk_debounce_free(data);
+}
+
+/*
+ * Called with scan_lock held when a replay starts. The scratch state takes
+ * the current window but starts from the same matrix as the live one and
+ * learns nothing from it.
+ */
+struct qmk_debounce *qmk_debounce_replay(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct qmk_debounce *debounce;
+
+	debounce = qmk_debounce_alloc(module);
+	if (!debounce)
+		return NULL;
+
+	debounce->fixed_us = module->debounce->fixed_us;
+	qmk_debounce_reset(debounce, keyboard->rows * keyboard->cols);
+	bitmap_copy(debounce->raw, module->last_key_state, module->matrix_bits);
+
+	return debounce;
+}
+QMK_EXPORT_IF_KUNIT(qmk_debounce_replay);
+
+int qmk_debounce_init(struct qmk_module *module)
+{
+	struct qmk_debounce *debounce;
+	int err;
+
+	debounce = qmk_debounce_alloc(module);
+	if (!debounce)
+		return -ENOMEM;
+
+	err = devm_add_action_or_reset(module->dev, qmk_debounce_release,
+				       debounce);
+	if (err)
+		return err;
+
+	module->debounce = debounce;
+
+	debugfs_create_file("debounce", 0400, module->debugfs, module,
+			    &qmk_debounce_fops);
+
+	return 0;
+}
+QMK_EXPORT_IF_KUNIT(qmk_debounce_init);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,209 @@
+/*
+ * Direct-pin keyboards, one GPIO per key
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitmap.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/module.h>
+#include <linux/pinctrl/consumer.h>
+#include <linux/pm_wakeup.h>
+#include <linux/workqueue.h>
+
+/*
+ * Every pin is a key on the single row of the keymap, so pin i is matrix
+ * column i. There is nothing to strobe; a key asserts its pin for as long
+ * as it is held.
+ */
+
+static bool qmk_direct_asserted(struct qmk_module *module, int pin)
+{
+	return gpio_get_value(module->sense_gpios[pin]) ?
+		       !module->strobe_active_low :
+		       module->strobe_active_low;
+}
+
+/* called from qmk_scan_matrix() with scan_lock held */
+void qmk_direct_read(struct qmk_module *module)
+{
+	int pin;
+
+	for (pin = 0; pin < module->num_sense; pin++) {
+		if (qmk_direct_asserted(module, pin))
+			__set_bit(pin << module->col_shift,
+				  module->current_key_state);
+	}
+}
+
+/*
+ * Debounce holds back a change that comes within a key's window of the
+ * last one. Polled keyboards report it on a later scan, but a pin that
+ * settles inside the window raises no edge after it, so the scan it needs
+ * is timed here for when the first held back change is due.
+ */
+static void qmk_direct_scan(struct qmk_module *module)
+{
+	u64 due;
+
+	qmk_scan_matrix(module);
+
+	mutex_lock(&module->scan_lock);
+	due = qmk_debounce_due(module->debounce);
+	mutex_unlock(&module->scan_lock);
+
+	if (due)
+		hrtimer_start(&module->direct_timer, ns_to_ktime(due),
+			      HRTIMER_MODE_ABS);
+}
+
+static void qmk_direct_work(struct work_struct *work)
+{
+	struct qmk_module *module =
+		container_of(work, struct qmk_module, direct_work);
+
+	if (!READ_ONCE(module->stopped))
+		qmk_direct_scan(module);
+}
+
+static enum hrtimer_restart qmk_direct_timer(struct hrtimer *timer)
+{
+	struct qmk_module *module =
+		container_of(timer, struct qmk_module, direct_timer);
+
+	schedule_work(&module->direct_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Any edge on any pin rescans all of them, so the reported state is always
+ * a consistent snapshot and a missed edge is corrected by the next one.
+ */
+static irqreturn_t qmk_direct_irq(int irq, void *id)
+{
+	struct qmk_module *module = id;
+
+	pm_wakeup_event(module->dev, 0);
+
+	if (!READ_ONCE(module->stopped))
+		qmk_direct_scan(module);
+
+	return IRQ_HANDLED;
+}
+
+int qmk_direct_init(struct platform_device *pdev, struct qmk_module *module)
+{
+	const struct qmk_platform_data *pdata = module->pdata;
+	unsigned int gpio;
+	int i, irq, err;
+
+	/* ktime_get_ns(), which debounce times changes by, is monotonic */
+	hrtimer_init(&module->direct_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	module->direct_timer.function = qmk_direct_timer;
+	INIT_WORK(&module->direct_work, qmk_direct_work);
+
+	for (i = 0; i < module->num_sense; i++) {
+		gpio = module->sense_gpios[i];
+
+		err = gpio_request(gpio, "matrix_kbd_direct");
+		if (err) {
+			dev_err(&pdev->dev,
+				"failed to request GPIO%d for key %d\n", gpio,
+				i);
+			goto err_free_pins;
+		}
+
+		gpio_direction_input(gpio);
+		pinctrl_gpio_set_config(gpio, pdata->active_low ?
+						      PIN_CONFIG_BIAS_PULL_UP :
+						      PIN_CONFIG_BIAS_PULL_DOWN);
+
+		irq = gpio_to_irq(gpio);
+		if (irq < 0) {
+			err = irq;
+			dev_err(&pdev->dev, "no interrupt for GPIO%d, err=%d\n",
+				gpio, err);
+			gpio_free(gpio);
+			goto err_free_pins;
+		}
+
+		/* enabled by qmk_direct_start() once the device is opened */
+		irq_set_status_flags(irq, IRQ_NOAUTOEN);
+		err = request_threaded_irq(irq, NULL, qmk_direct_irq,
+					   IRQF_TRIGGER_RISING |
+						   IRQF_TRIGGER_FALLING |
+						   IRQF_ONESHOT,
+					   "qmk-direct", module);
+		if (err) {
+			dev_err(&pdev->dev,
+				"failed to request IRQ%d for key %d, err=%d\n",
+				irq, i, err);
+			gpio_free(gpio);
+			goto err_free_pins;
+		}
+	}
+
+	return 0;
+
+err_free_pins:
+	while (--i >= 0) {
+		free_irq(gpio_to_irq(module->sense_gpios[i]), module);
+		gpio_free(module->sense_gpios[i]);
+	}
+
+	return err;
+}
+
+void qmk_direct_free(struct qmk_module *module)
+{
+	int i;
+
+	for (i = 0; i < module->num_sense; i++) {
+		free_irq(gpio_to_irq(module->sense_gpios[i]), module);
+		gpio_free(module->sense_gpios[i]);
+	}
+}
+
+/*
+ * Reads the pins once so keys already held when the device is opened are
+ * reported, then lets the edge interrupts, and the debounce timer, drive
+ * every following scan.
+ */
+void qmk_direct_start(struct qmk_module *module)
+{
+	int i;
+
+	for (i = 0; i < module->num_sense; i++)
+		enable_irq(gpio_to_irq(module->sense_gpios[i]));
+
+	qmk_direct_scan(module);
+}
+
+void qmk_direct_stop(struct qmk_module *module)
+{
+	int i;
+
+	for (i = 0; i < module->num_sense; i++)
+		disable_irq(gpio_to_irq(module->sense_gpios[i]));
+
+	/* with the interrupts off, only the work can rearm the timer */
+	hrtimer_cancel(&module->direct_timer);
+	cancel_work_sync(&module->direct_work);
+	hrtimer_cancel(&module->direct_timer);
+}
+
+MODULE_LICENSE("GPL");
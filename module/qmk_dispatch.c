@@ -0,0 +1,157 @@
+/*
+ * Quantum keycode dispatch
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_dispatch.h"
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/srcu.h>
+
+/*
+ * Keycodes libqmk leaves alone are looked up by their high byte in
+ * qmk_keycode_pages[], then by their low byte in the page found there, so
+ * a keycode nobody registered costs two loads whatever is registered.
+ * Pages are allocated for the high bytes something gets registered in, and
+ * kept until the module goes.
+ *
+ * Handlers may sleep, so the scan reads the table under SRCU. Entries are
+ * set and cleared in place; unregistering waits for the scans that may
+ * still have seen the old entries, so the handler is no longer running
+ * once it returns.
+ */
+
+#define QMK_KEYCODE_PAGES 256
+
+struct qmk_keycode_page {
+	const struct qmk_keycode_handler __rcu *handler[256];
+};
+
+static struct qmk_keycode_page __rcu *qmk_keycode_pages[QMK_KEYCODE_PAGES];
+static DEFINE_MUTEX(qmk_keycode_lock);
+DEFINE_STATIC_SRCU(qmk_keycode_srcu);
+
+static struct qmk_keycode_page *qmk_keycode_page(unsigned int code)
+{
+	return rcu_dereference_protected(qmk_keycode_pages[code >> 8],
+					 lockdep_is_held(&qmk_keycode_lock));
+}
+
+static const struct qmk_keycode_handler *
+qmk_keycode_entry(struct qmk_keycode_page *page, unsigned int code)
+{
+	return rcu_dereference_protected(page->handler[code & 0xff],
+					 lockdep_is_held(&qmk_keycode_lock));
+}
+
+int qmk_register_keycodes(const struct qmk_keycode_handler *handler)
+{
+	struct qmk_keycode_page *page;
+	unsigned int code;
+	int err = 0;
+
+	if (!handler->process || handler->first > handler->last)
+		return -EINVAL;
+
+	mutex_lock(&qmk_keycode_lock);
+
+	for (code = handler->first; code <= handler->last; code++) {
+		page = qmk_keycode_page(code);
+		if (page && qmk_keycode_entry(page, code)) {
+			pr_err("qmk: keycode 0x%04x is already handled\n",
+			       code);
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	/* allocate every page first, so nothing is left half registered */
+	for (code = handler->first; code <= handler->last; code++) {
+		if (qmk_keycode_page(code))
+			continue;
+		page = kzalloc(sizeof(*page), GFP_KERNEL);
+		if (!page) {
+			err = -ENOMEM;
+			goto out;
+		}
+		rcu_assign_pointer(qmk_keycode_pages[code >> 8], page);
+	}
+
+	for (code = handler->first; code <= handler->last; code++)
+		rcu_assign_pointer(qmk_keycode_page(code)->handler[code & 0xff],
+				   handler);
+
+out:
+	mutex_unlock(&qmk_keycode_lock);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(qmk_register_keycodes);
+
+void qmk_unregister_keycodes(const struct qmk_keycode_handler *handler)
+{
+	struct qmk_keycode_page *page;
+	unsigned int code;
+
+	mutex_lock(&qmk_keycode_lock);
+
+	for (code = handler->first; code <= handler->last; code++) {
+		page = qmk_keycode_page(code);
+		if (page && qmk_keycode_entry(page, code) == handler)
+			RCU_INIT_POINTER(page->handler[code & 0xff], NULL);
+	}
+
+	mutex_unlock(&qmk_keycode_lock);
+
+	synchronize_srcu(&qmk_keycode_srcu);
+}
+EXPORT_SYMBOL_GPL(qmk_unregister_keycodes);
+
+bool process_qkm(struct qmk_keyboard *keyboard, qmk_keycode_t *keycode,
+		 bool pressed)
+{
+	const struct qmk_keycode_handler *handler = NULL;
+	struct qmk_keycode_page *page;
+	u16 code = *keycode;
+	bool handled = false;
+	int srcu;
+
+	srcu = srcu_read_lock(&qmk_keycode_srcu);
+	page = srcu_dereference(qmk_keycode_pages[code >> 8],
+				&qmk_keycode_srcu);
+	if (page)
+		handler = srcu_dereference(page->handler[code & 0xff],
+					   &qmk_keycode_srcu);
+	if (handler)
+		handled = handler->process(keyboard, code, pressed,
+					   handler->data);
+	srcu_read_unlock(&qmk_keycode_srcu, srcu);
+
+	return handled;
+}
+
+/* called once no keyboard is left */
+void qmk_dispatch_exit(void)
+{
+	unsigned int hi;
+
+	for (hi = 0; hi < QMK_KEYCODE_PAGES; hi++) {
+		kfree(rcu_dereference_protected(qmk_keycode_pages[hi], 1));
+		RCU_INIT_POINTER(qmk_keycode_pages[hi], NULL);
+	}
+}
+
+MODULE_LICENSE("GPL");
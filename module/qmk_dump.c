@@ -0,0 +1,172 @@
+/*
+ * Keymap and layer state snapshots
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_keymap.h"
+#include "qmk_socket.h"
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <asm/byteorder.h>
+
+/*
+ * A dump is taken with scan_lock held, so the layer state and the keymap
+ * it was reached with come from between the same two scans. The sysfs copy
+ * is taken again whenever it is read from the start, and kept for the
+ * reads that follow at higher offsets.
+ */
+
+/* keyboards to answer KEYMAP_DUMP and ACTIVE_PROFILE requests for */
+static LIST_HEAD(qmk_dump_modules);
+static DEFINE_MUTEX(qmk_dump_modules_lock);
+
+static size_t qmk_dump_size(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+
+	return QMK_DUMP_SIZE(keyboard->layers, keyboard->rows, keyboard->cols);
+}
+
+static void qmk_dump_fill(struct qmk_module *module,
+			  struct qmk_keymap_dump *dump)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	const unsigned short *keymap;
+	unsigned int profile;
+	int srcu;
+
+	mutex_lock(&module->scan_lock);
+	srcu = srcu_read_lock(&module->keymap_srcu);
+
+	keymap = qmk_reload_current(module, &profile);
+	qmk_reload_export(module, keymap, profile, &dump->keymap);
+
+	dump->magic = cpu_to_le32(QMK_DUMP_MAGIC);
+	dump->version = cpu_to_le16(QMK_DUMP_VERSION);
+	dump->num_profiles = module->num_profiles;
+	dump->active_layer = keyboard->active_layer;
+	dump->layer_state = cpu_to_le32(keyboard->layer_state);
+
+	srcu_read_unlock(&module->keymap_srcu, srcu);
+	mutex_unlock(&module->scan_lock);
+}
+
+ssize_t qmk_dump_read(struct qmk_module *module, char *buf, loff_t off,
+		      size_t count)
+{
+	ssize_t len;
+
+	mutex_lock(&module->dump_lock);
+
+	if (!module->dump) {
+		module->dump_size = qmk_dump_size(module);
+		module->dump = kvmalloc(module->dump_size, GFP_KERNEL);
+		if (!module->dump) {
+			mutex_unlock(&module->dump_lock);
+			return -ENOMEM;
+		}
+		off = 0;
+		qmk_dump_fill(module, module->dump);
+	} else if (!off) {
+		qmk_dump_fill(module, module->dump);
+	}
+
+	len = memory_read_from_buffer(buf, count, &off, module->dump,
+				      module->dump_size);
+	mutex_unlock(&module->dump_lock);
+
+	return len;
+}
+
+/*
+ * Answers a KEYMAP_DUMP request with one message per keyboard, sent to the
+ * socket that asked only
+ */
+void qmk_dump_request(u32 portid)
+{
+	struct qmk_module *module;
+	size_t size;
+	u8 *msg;
+	int err;
+
+	mutex_lock(&qmk_dump_modules_lock);
+	list_for_each_entry(module, &qmk_dump_modules, dump_node) {
+		size = qmk_dump_size(module);
+		msg = kvmalloc(size + 2, GFP_KERNEL);
+		if (!msg)
+			break;
+
+		msg[0] = 0;
+		msg[1] = KEYMAP_DUMP;
+		qmk_dump_fill(module, (struct qmk_keymap_dump *)(msg + 2));
+
+		err = unicast_socket_message(portid, msg, size + 2);
+		kvfree(msg);
+		if (err) {
+			dev_dbg(module->dev, "unable to send keymap dump, err=%d\n",
+				err);
+			break;
+		}
+	}
+	mutex_unlock(&qmk_dump_modules_lock);
+}
+
+/*
+ * Answers an ACTIVE_PROFILE request by switching every keyboard that has
+ * @profile to it, as writing to the profile sysfs file does
+ */
+void qmk_profile_request(unsigned int profile)
+{
+	struct qmk_module *module;
+	int err;
+
+	mutex_lock(&qmk_dump_modules_lock);
+	list_for_each_entry(module, &qmk_dump_modules, dump_node) {
+		mutex_lock(&module->scan_lock);
+		err = qmk_profile_select(module, profile);
+		send_socket_message();
+		mutex_unlock(&module->scan_lock);
+		if (err)
+			dev_dbg(module->dev, "no profile %u, err=%d\n",
+				profile, err);
+	}
+	mutex_unlock(&qmk_dump_modules_lock);
+}
+
+/* called once the keyboard is registered */
+void qmk_dump_init(struct qmk_module *module)
+{
+	mutex_init(&module->dump_lock);
+
+	mutex_lock(&qmk_dump_modules_lock);
+	list_add_tail(&module->dump_node, &qmk_dump_modules);
+	mutex_unlock(&qmk_dump_modules_lock);
+}
+
+void qmk_dump_exit(struct qmk_module *module)
+{
+	mutex_lock(&qmk_dump_modules_lock);
+	list_del(&module->dump_node);
+	mutex_unlock(&qmk_dump_modules_lock);
+
+	kvfree(module->dump);
+	module->dump = NULL;
+}
+
+MODULE_LICENSE("GPL");
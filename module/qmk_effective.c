@@ -0,0 +1,362 @@
+/*
+ * Effective keymap cache, keyed by layer state
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <asm/barrier.h>
+#include <qmk/keycodes/basic.h>
+
+/*
+ * Each slot holds the keycode every key resolves to under one layer state,
+ * after walking the active layers past transparent entries. The slot of
+ * the current state is used for every event; when the state changes, a
+ * slot already holding the new state is picked up as is, otherwise the
+ * least recently used one is refilled from the current slot and only the
+ * keys defined on a layer that was switched on or off are resolved again.
+ *
+ * The keycode found is handed to libqmk with the event, so every key still
+ * goes through libqmk and its tap, hold and modifier tracking sees every
+ * press; only the walk down the layers is saved. A release is handed the
+ * keycode its press was.
+ *
+ * A key held while a new keymap is published may still be looked up in the
+ * new one by libqmk when it comes up, so a basic keycode it was pressed as
+ * is released once more after libqmk; the input core ignores the release
+ * of a key that is already up.
+ *
+ * A single key remapped in place is marked stale, and only that key is
+ * resolved again in every slot on the next press.
+ */
+
+/**
+ * struct qmk_effective_slot - effective keymap of one layer state
+ * @state: layer state the keycodes were resolved for
+ * @used: value of the cache clock when the slot was last made current
+ * @keycodes: resolved keycode per key, row-major
+ */
+struct qmk_effective_slot {
+	u32 state;
+	u64 used;
+	u16 *keycodes;
+};
+
+/**
+ * struct qmk_effective - effective keymap cache of one keyboard
+ * @keymap_gen: module->keymap_gen the cache was built for, a newer one
+ *  means the keymap was reloaded and the cache is stale
+ * @defined: per layer, keys that are not transparent on that layer
+ * @scratch: keys to resolve again on a state change
+ * @stale: keys remapped since they were last resolved
+ * @stale_pending: @stale has bits set
+ * @held: keycode each key was pressed as
+ * @held_gen: keymap_gen each key was pressed under
+ * @current: slot of the current layer state
+ * @clock: bumped every time a slot is made current
+ * @keys: rows * cols
+ * @longs: longs in each layer's @defined bitmap
+ * @slot: the slots
+ */
+struct qmk_effective {
+	unsigned int keymap_gen;
+	unsigned long *defined;
+	unsigned long *scratch;
+	unsigned long *stale;
+	bool stale_pending;
+	u16 *held;
+	unsigned int *held_gen;
+	struct qmk_effective_slot *current;
+	u64 clock;
+	unsigned int keys;
+	unsigned int longs;
+	struct qmk_effective_slot slot[QMK_EFFECTIVE_SLOTS];
+};
+
+static unsigned short qmk_effective_entry(struct qmk_module *module,
+					  unsigned int layer, unsigned int key)
+{
+	const unsigned short *keymap = module->keyboard->keymap;
+	unsigned int cols = module->keyboard->cols;
+
+	return keymap[QMK_MATRIX_SCAN_CODE(layer, key / cols, key % cols,
+					   module->layer_shift,
+					   module->row_shift)];
+}
+
+static u16 qmk_effective_resolve(struct qmk_module *module, u32 state,
+				 unsigned int key)
+{
+	unsigned short code;
+	int layer;
+
+	/* layer bits past the keymap have no table behind them */
+	state &= GENMASK(module->keyboard->layers - 1, 0);
+
+	for (layer = fls(state) - 1; layer >= 0; layer--) {
+		if (!(state & BIT(layer)))
+			continue;
+
+		code = qmk_effective_entry(module, layer, key);
+		if (code != KC_TRNS)
+			return code;
+	}
+
+	return KC_NO;
+}
+
+static void qmk_effective_fill(struct qmk_module *module,
+			       struct qmk_effective_slot *slot, u32 state)
+{
+	struct qmk_effective *effective = module->effective;
+	unsigned int key;
+
+	for (key = 0; key < effective->keys; key++)
+		slot->keycodes[key] = qmk_effective_resolve(module, state, key);
+	slot->state = state;
+}
+
+/* the keymap changed under the cache, start over from it */
+static void qmk_effective_rebuild(struct qmk_module *module,
+				  unsigned int keymap_gen)
+{
+	struct qmk_effective *effective = module->effective;
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned long *defined;
+	unsigned int layer, key;
+	int i;
+
+	for (layer = 0; layer < keyboard->layers; layer++) {
+		defined = effective->defined + layer * effective->longs;
+		bitmap_zero(defined, effective->keys);
+		for (key = 0; key < effective->keys; key++)
+			if (qmk_effective_entry(module, layer, key) != KC_TRNS)
+				__set_bit(key, defined);
+	}
+
+	/* a full rebuild covers every remapped key */
+	WRITE_ONCE(effective->stale_pending, false);
+	smp_mb();
+	bitmap_zero(effective->stale, effective->keys);
+
+	for (i = 0; i < QMK_EFFECTIVE_SLOTS; i++)
+		effective->slot[i].used = 0;
+
+	effective->keymap_gen = keymap_gen;
+	effective->current = &effective->slot[0];
+	effective->current->used = ++effective->clock;
+	qmk_effective_fill(module, effective->current, keyboard->layer_state);
+}
+
+/* one key was remapped, walks its layers again in every slot */
+static void qmk_effective_refresh_key(struct qmk_module *module,
+				      unsigned int key)
+{
+	struct qmk_effective *effective = module->effective;
+	struct qmk_effective_slot *slot;
+	unsigned long *defined;
+	unsigned int layer;
+	int i;
+
+	for (layer = 0; layer < module->keyboard->layers; layer++) {
+		defined = effective->defined + layer * effective->longs;
+		if (qmk_effective_entry(module, layer, key) != KC_TRNS)
+			__set_bit(key, defined);
+		else
+			__clear_bit(key, defined);
+	}
+
+	for (i = 0; i < QMK_EFFECTIVE_SLOTS; i++) {
+		slot = &effective->slot[i];
+		if (slot->used)
+			slot->keycodes[key] =
+				qmk_effective_resolve(module, slot->state, key);
+	}
+}
+
+static void qmk_effective_refresh(struct qmk_module *module)
+{
+	struct qmk_effective *effective = module->effective;
+	unsigned int key;
+
+	WRITE_ONCE(effective->stale_pending, false);
+	/* pairs with qmk_effective_invalidate() */
+	smp_mb();
+
+	for_each_set_bit(key, effective->stale, effective->keys) {
+		clear_bit(key, effective->stale);
+		qmk_effective_refresh_key(module, key);
+	}
+}
+
+/*
+ * Called with input->event_lock held once the keymap entry of @key has
+ * been changed in place
+ */
+void qmk_effective_invalidate(struct qmk_module *module, unsigned int key)
+{
+	struct qmk_effective *effective = module->effective;
+
+	set_bit(key, effective->stale);
+	smp_mb__after_atomic();
+	WRITE_ONCE(effective->stale_pending, true);
+}
+
+static void qmk_effective_switch(struct qmk_module *module, u32 state)
+{
+	struct qmk_effective *effective = module->effective;
+	struct qmk_effective_slot *current = effective->current;
+	struct qmk_effective_slot *slot, *victim = NULL;
+	unsigned long flipped;
+	unsigned int layer, key;
+	int i;
+
+	for (i = 0; i < QMK_EFFECTIVE_SLOTS; i++) {
+		slot = &effective->slot[i];
+		if (slot->used && slot->state == state)
+			goto out;
+		if (slot != current && (!victim || slot->used < victim->used))
+			victim = slot;
+	}
+
+	slot = victim;
+	memcpy(slot->keycodes, current->keycodes,
+	       effective->keys * sizeof(*slot->keycodes));
+
+	flipped = (current->state ^ state) &
+		  GENMASK(module->keyboard->layers - 1, 0);
+	bitmap_zero(effective->scratch, effective->keys);
+	for_each_set_bit(layer, &flipped, BITS_PER_LONG)
+		bitmap_or(effective->scratch, effective->scratch,
+			  effective->defined + layer * effective->longs,
+			  effective->keys);
+
+	for_each_set_bit(key, effective->scratch, effective->keys)
+		slot->keycodes[key] = qmk_effective_resolve(module, state, key);
+	slot->state = state;
+
+out:
+	slot->used = ++effective->clock;
+	effective->current = slot;
+}
+
+/*
+ * Called for every event with scan_lock and keymap_srcu held, before
+ * libqmk. Sets @keycode to what the key resolves to under the current
+ * layer state, or on release to what it was pressed as. Returns true for
+ * the release of a key pressed under a keymap replaced since, see
+ * qmk_effective_release().
+ */
+bool qmk_effective_lookup(struct qmk_module *module,
+			  struct qmk_matrix_event *event,
+			  qmk_keycode_t *keycode)
+{
+	struct qmk_effective *effective = module->effective;
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int key = event->row * keyboard->cols + event->col;
+	unsigned int keymap_gen;
+
+	if (!event->pressed) {
+		*keycode = effective->held[key];
+		effective->held[key] = 0;
+		return effective->held_gen[key] !=
+		       smp_load_acquire(&module->keymap_gen);
+	}
+
+	/* pairs with qmk_reload_commit(), the new table is seen with it */
+	keymap_gen = smp_load_acquire(&module->keymap_gen);
+	if (effective->keymap_gen != keymap_gen) {
+		qmk_effective_rebuild(module, keymap_gen);
+	} else {
+		if (READ_ONCE(effective->stale_pending))
+			qmk_effective_refresh(module);
+		if (effective->current->state != keyboard->layer_state)
+			qmk_effective_switch(module, keyboard->layer_state);
+	}
+
+	*keycode = effective->current->keycodes[key];
+	effective->held[key] = *keycode;
+	effective->held_gen[key] = effective->keymap_gen;
+
+	return false;
+}
+
+/*
+ * Called after libqmk for a release qmk_effective_lookup() returned true
+ * for, @code being what the key was pressed as. Another key still held as
+ * the same keycode keeps it down.
+ */
+void qmk_effective_release(struct qmk_module *module, u16 code)
+{
+	struct qmk_effective *effective = module->effective;
+	unsigned int key;
+
+	if (code <= KC_TRNS || code >= 0xFF)
+		return;
+
+	for (key = 0; key < effective->keys; key++)
+		if (effective->held[key] == code)
+			return;
+
+	send_keycode(module->keyboard, code, false);
+}
+
+int qmk_effective_init(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct qmk_effective *effective;
+	unsigned int keys = keyboard->rows * keyboard->cols;
+	unsigned int longs = BITS_TO_LONGS(keys);
+	int i;
+
+	effective = devm_kzalloc(module->dev, sizeof(*effective), GFP_KERNEL);
+	if (!effective)
+		return -ENOMEM;
+
+	effective->keys = keys;
+	effective->longs = longs;
+	effective->defined = devm_kcalloc(module->dev, keyboard->layers * longs,
+					  sizeof(unsigned long), GFP_KERNEL);
+	effective->scratch = devm_kcalloc(module->dev, longs,
+					  sizeof(unsigned long), GFP_KERNEL);
+	effective->stale = devm_kcalloc(module->dev, longs,
+					sizeof(unsigned long), GFP_KERNEL);
+	effective->held = devm_kcalloc(module->dev, keys, sizeof(u16),
+				       GFP_KERNEL);
+	effective->held_gen = devm_kcalloc(module->dev, keys,
+					   sizeof(unsigned int), GFP_KERNEL);
+	if (!effective->defined || !effective->scratch || !effective->stale ||
+	    !effective->held || !effective->held_gen)
+		return -ENOMEM;
+
+	for (i = 0; i < QMK_EFFECTIVE_SLOTS; i++) {
+		effective->slot[i].keycodes = devm_kcalloc(module->dev, keys,
+							   sizeof(u16),
+							   GFP_KERNEL);
+		if (!effective->slot[i].keycodes)
+			return -ENOMEM;
+	}
+
+	module->effective = effective;
+	qmk_effective_rebuild(module, module->keymap_gen);
+
+	return 0;
+}
+QMK_EXPORT_IF_KUNIT(qmk_effective_init);
+
+MODULE_LICENSE("GPL");
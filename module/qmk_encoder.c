@@ -0,0 +1,371 @@
+/*
+ * Rotary encoders decoded from their edge interrupts
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/atomic.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <qmk/protocol.h>
+#include "qmk_scancodes.h"
+
+/* detents are never multiplied by more than this when accelerating */
+#define QMK_ENCODER_ACCEL_MAX 8
+
+/**
+ * struct qmk_encoder - one quadrature encoder
+ * @encoders: set this encoder belongs to
+ * @gpio_a: A phase
+ * @gpio_b: B phase
+ * @keys: keycodes tapped for a clockwise and a counter-clockwise detent
+ * @state: last A/B levels, A in bit 1
+ * @pulses: transitions seen since the last full detent, signed
+ * @last_ns: time of the last full detent
+ * @pending: detents not yet reported, positive clockwise
+ * @lock: serializes the A and B interrupt threads
+ */
+struct qmk_encoder {
+	struct qmk_encoders *encoders;
+	unsigned int gpio_a;
+	unsigned int gpio_b;
+	u16 keys[2];
+	u8 state;
+	int pulses;
+	u64 last_ns;
+	atomic_t pending;
+	spinlock_t lock;
+};
+
+/**
+ * struct qmk_encoders - rotary encoders of one keyboard
+ * @module: owning module
+ * @work: reports pending detents
+ * @resolution: quadrature transitions per detent
+ * @accel_ns: detents closer together than this are multiplied, 0 disables
+ *  acceleration
+ * @count: number of encoders
+ * @encoder: the encoders
+ */
+struct qmk_encoders {
+	struct qmk_module *module;
+	struct work_struct work;
+	unsigned int resolution;
+	u64 accel_ns;
+	unsigned int count;
+	struct qmk_encoder encoder[];
+};
+
+/*
+ * Indexed by the previous and the current A/B levels. Invalid transitions,
+ * where both phases changed at once, count as no movement so a bouncing
+ * contact cannot run the count away.
+ */
+static const s8 qmk_encoder_table[16] = {
+	0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0,
+};
+
+static u8 qmk_encoder_read(struct qmk_encoder *encoder)
+{
+	return (gpio_get_value(encoder->gpio_a) ? 2 : 0) |
+	       (gpio_get_value(encoder->gpio_b) ? 1 : 0);
+}
+
+/* spinning faster than accel_ns per detent counts each detent several times */
+static int qmk_encoder_accelerate(struct qmk_encoder *encoder, u64 now)
+{
+	struct qmk_encoders *encoders = encoder->encoders;
+	u64 interval = now - encoder->last_ns;
+
+	encoder->last_ns = now;
+
+	if (!encoders->accel_ns || interval >= encoders->accel_ns)
+		return 1;
+
+	return min_t(u64, div64_u64(encoders->accel_ns, interval ?: 1),
+		     QMK_ENCODER_ACCEL_MAX);
+}
+
+/*
+ * Decoding happens in the interrupt so no transition is missed however
+ * fast the knob spins; reporting is batched in qmk_encoder_work().
+ */
+static irqreturn_t qmk_encoder_irq(int irq, void *id)
+{
+	struct qmk_encoder *encoder = id;
+	struct qmk_encoders *encoders = encoder->encoders;
+	unsigned long flags;
+	int detents = 0;
+	u8 state;
+
+	spin_lock_irqsave(&encoder->lock, flags);
+
+	state = qmk_encoder_read(encoder);
+	encoder->pulses += qmk_encoder_table[(encoder->state << 2) | state];
+	encoder->state = state;
+
+	if (abs(encoder->pulses) >= encoders->resolution) {
+		detents = qmk_encoder_accelerate(encoder, ktime_get_ns());
+		if (encoder->pulses < 0)
+			detents = -detents;
+		encoder->pulses = 0;
+	}
+
+	spin_unlock_irqrestore(&encoder->lock, flags);
+
+	if (detents) {
+		atomic_add(detents, &encoder->pending);
+		schedule_work(&encoders->work);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static bool qmk_encoder_basic(u16 keycode)
+{
+	return keycode < ARRAY_SIZE(keycode_to_scancode);
+}
+
+/*
+ * Basic keycodes, media keys among them, go straight to the input device.
+ * There is no matrix position to hand libqmk, so any other keycode goes to
+ * the quantum keycode handlers alone, and is counted as unhandled like a
+ * key's when none takes it.
+ */
+static void qmk_encoder_send(struct qmk_module *module, u16 keycode,
+			     bool pressed)
+{
+	qmk_keycode_t code = keycode;
+
+	if (qmk_encoder_basic(keycode)) {
+		send_keycode(module->keyboard, keycode, pressed);
+	} else if (!process_qkm(module->keyboard, &code, pressed)) {
+		module->unhandled_count++;
+		dev_dbg_ratelimited(&module->input_dev->dev,
+				    "unhandled keycode: 0x%x\n", keycode);
+	}
+	input_sync(module->input_dev);
+}
+
+static void qmk_encoder_tap(struct qmk_module *module, u16 keycode)
+{
+	if (!keycode)
+		return;
+
+	qmk_encoder_send(module, keycode, true);
+	qmk_encoder_send(module, keycode, false);
+}
+
+/*
+ * Every detent that arrived since the last run is reported as one tap of
+ * the encoder's keycode, under scan_lock so taps never interleave with a
+ * matrix scan's events.
+ */
+static void qmk_encoder_work(struct work_struct *work)
+{
+	struct qmk_encoders *encoders =
+		container_of(work, struct qmk_encoders, work);
+	struct qmk_module *module = encoders->module;
+	struct qmk_encoder *encoder;
+	int i, detents;
+
+	mutex_lock(&module->scan_lock);
+
+	for (i = 0; i < encoders->count; i++) {
+		encoder = &encoders->encoder[i];
+		detents = atomic_xchg(&encoder->pending, 0);
+
+		for (; detents > 0; detents--)
+			qmk_encoder_tap(module, encoder->keys[0]);
+		for (; detents < 0; detents++)
+			qmk_encoder_tap(module, encoder->keys[1]);
+	}
+
+	send_socket_message();
+	mutex_unlock(&module->scan_lock);
+}
+
+static int qmk_encoder_request(struct device *dev, struct qmk_encoder *encoder,
+			       unsigned int gpio)
+{
+	int irq, err;
+
+	err = gpio_request(gpio, "qmk_encoder");
+	if (err) {
+		dev_err(dev, "failed to request GPIO%d for encoder\n", gpio);
+		return err;
+	}
+
+	gpio_direction_input(gpio);
+
+	irq = gpio_to_irq(gpio);
+	if (irq < 0) {
+		dev_err(dev, "no interrupt for GPIO%d, err=%d\n", gpio, irq);
+		gpio_free(gpio);
+		return irq;
+	}
+
+	/* enabled by qmk_encoder_start() once the device is opened */
+	irq_set_status_flags(irq, IRQ_NOAUTOEN);
+	err = request_threaded_irq(irq, NULL, qmk_encoder_irq,
+				   IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+					   IRQF_ONESHOT,
+				   "qmk-encoder", encoder);
+	if (err) {
+		dev_err(dev, "failed to request IRQ%d for encoder, err=%d\n",
+			irq, err);
+		gpio_free(gpio);
+		return err;
+	}
+
+	return 0;
+}
+
+static void qmk_encoder_release(struct qmk_encoder *encoder, unsigned int gpio)
+{
+	free_irq(gpio_to_irq(gpio), encoder);
+	gpio_free(gpio);
+}
+
+int qmk_encoder_init(struct qmk_module *module)
+{
+	const struct qmk_platform_data *pdata = module->pdata;
+	struct input_dev *input = module->input_dev;
+	struct qmk_encoders *encoders;
+	struct qmk_encoder *encoder;
+	int i, k, err;
+
+	if (!pdata->num_encoders)
+		return 0;
+
+	encoders = devm_kzalloc(module->dev,
+				struct_size(encoders, encoder,
+					    pdata->num_encoders),
+				GFP_KERNEL);
+	if (!encoders)
+		return -ENOMEM;
+
+	encoders->module = module;
+	encoders->count = pdata->num_encoders;
+	encoders->resolution = max(pdata->encoder_resolution, 1U);
+	encoders->accel_ns = (u64)pdata->encoder_accel_ms * NSEC_PER_MSEC;
+	INIT_WORK(&encoders->work, qmk_encoder_work);
+
+	for (i = 0; i < encoders->count; i++) {
+		encoder = &encoders->encoder[i];
+		encoder->encoders = encoders;
+		spin_lock_init(&encoder->lock);
+		encoder->gpio_a = pdata->encoder_gpios[2 * i];
+		encoder->gpio_b = pdata->encoder_gpios[2 * i + 1];
+
+		for (k = 0; k < 2; k++) {
+			encoder->keys[k] = pdata->encoder_keys[2 * i + k];
+			if (qmk_encoder_basic(encoder->keys[k]))
+				__set_bit(keycode_to_scancode[encoder->keys[k]],
+					  input->keybit);
+		}
+
+		err = qmk_encoder_request(module->dev, encoder,
+					  encoder->gpio_a);
+		if (err)
+			goto err_free_encoders;
+
+		err = qmk_encoder_request(module->dev, encoder,
+					  encoder->gpio_b);
+		if (err) {
+			qmk_encoder_release(encoder, encoder->gpio_a);
+			goto err_free_encoders;
+		}
+	}
+
+	module->encoders = encoders;
+
+	return 0;
+
+err_free_encoders:
+	while (--i >= 0) {
+		encoder = &encoders->encoder[i];
+		qmk_encoder_release(encoder, encoder->gpio_b);
+		qmk_encoder_release(encoder, encoder->gpio_a);
+	}
+
+	return err;
+}
+
+void qmk_encoder_exit(struct qmk_module *module)
+{
+	struct qmk_encoders *encoders = module->encoders;
+	struct qmk_encoder *encoder;
+	int i;
+
+	if (!encoders)
+		return;
+
+	for (i = 0; i < encoders->count; i++) {
+		encoder = &encoders->encoder[i];
+		qmk_encoder_release(encoder, encoder->gpio_b);
+		qmk_encoder_release(encoder, encoder->gpio_a);
+	}
+
+	cancel_work_sync(&encoders->work);
+	module->encoders = NULL;
+}
+
+void qmk_encoder_start(struct qmk_module *module)
+{
+	struct qmk_encoders *encoders = module->encoders;
+	struct qmk_encoder *encoder;
+	int i;
+
+	if (!encoders)
+		return;
+
+	for (i = 0; i < encoders->count; i++) {
+		encoder = &encoders->encoder[i];
+		encoder->state = qmk_encoder_read(encoder);
+		encoder->pulses = 0;
+		encoder->last_ns = 0;
+		atomic_set(&encoder->pending, 0);
+
+		enable_irq(gpio_to_irq(encoder->gpio_a));
+		enable_irq(gpio_to_irq(encoder->gpio_b));
+	}
+}
+
+void qmk_encoder_stop(struct qmk_module *module)
+{
+	struct qmk_encoders *encoders = module->encoders;
+	struct qmk_encoder *encoder;
+	int i;
+
+	if (!encoders)
+		return;
+
+	for (i = 0; i < encoders->count; i++) {
+		encoder = &encoders->encoder[i];
+		disable_irq(gpio_to_irq(encoder->gpio_a));
+		disable_irq(gpio_to_irq(encoder->gpio_b));
+	}
+
+	cancel_work_sync(&encoders->work);
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,106 @@
+/*
+ * Activity-adaptive scan rate
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+
+/*
+ * The governor scans at min_interval while anything happens on the matrix.
+ * After idle_scans quiet scans it halves the rate, and keeps halving it
+ * every idle_scans quiet scans until max_interval is reached. Any change,
+ * or a key being held, jumps straight back to the fastest rate.
+ */
+
+unsigned int qmk_governor_level_interval(const struct qmk_governor *governor,
+					 unsigned int level)
+{
+	if (level >= governor->levels - 1)
+		return governor->max_interval;
+
+	return governor->min_interval << level;
+}
+
+static void qmk_governor_set_level(struct qmk_governor *governor,
+				   unsigned int level, u64 now)
+{
+	governor->level_ns[governor->level] += now - governor->since;
+	governor->since = now;
+	governor->level = level;
+	governor->quiet = 0;
+	WRITE_ONCE(governor->interval,
+		   qmk_governor_level_interval(governor, level));
+}
+
+/* called with scan_lock held, e.g. when the scan parameters change */
+void __qmk_governor_init(struct qmk_module *module, unsigned int min_interval,
+			 unsigned int max_interval, unsigned int idle_scans)
+{
+	struct qmk_governor *governor = &module->governor;
+
+	governor->min_interval = max(min_interval, 1U);
+	governor->max_interval = max(max_interval, governor->min_interval);
+	governor->idle_scans = max(idle_scans, 1U);
+
+	governor->levels = 1;
+	while (governor->levels < QMK_GOVERNOR_LEVELS &&
+	       (governor->min_interval << (governor->levels - 1)) <
+		       governor->max_interval)
+		governor->levels++;
+
+	memset(governor->level_ns, 0, sizeof(governor->level_ns));
+	governor->level = 0;
+	governor->since = ktime_get_ns();
+	qmk_governor_set_level(governor, 0, governor->since);
+}
+
+void qmk_governor_init(struct qmk_module *module, unsigned int min_interval,
+		       unsigned int max_interval, unsigned int idle_scans)
+{
+	mutex_lock(&module->scan_lock);
+	__qmk_governor_init(module, min_interval, max_interval, idle_scans);
+	mutex_unlock(&module->scan_lock);
+}
+
+/* back to the fastest rate, e.g. when scanning (re)starts */
+void qmk_governor_reset(struct qmk_module *module)
+{
+	mutex_lock(&module->scan_lock);
+	qmk_governor_set_level(&module->governor, 0, ktime_get_ns());
+	mutex_unlock(&module->scan_lock);
+}
+
+/* called with scan_lock held after every scan */
+void qmk_governor_update(struct qmk_module *module, bool active)
+{
+	struct qmk_governor *governor = &module->governor;
+
+	if (active) {
+		if (governor->level)
+			qmk_governor_set_level(governor, 0, ktime_get_ns());
+		governor->quiet = 0;
+		return;
+	}
+
+	if (governor->level == governor->levels - 1)
+		return;
+
+	if (++governor->quiet >= governor->idle_scans)
+		qmk_governor_set_level(governor, governor->level + 1,
+				       ktime_get_ns());
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,153 @@
+/*
+ * Per-key health counters
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_health.h"
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/*
+ * The table is kept ready to be read out as is: the header followed by one
+ * 16 byte entry per key. Only the entries of keys that changed are touched
+ * by a scan, so the cost is a cache line per change.
+ */
+
+int qmk_health_init(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct qmk_health_header *header;
+	size_t size;
+
+	size = sizeof(*header) +
+	       keyboard->rows * keyboard->cols * sizeof(struct qmk_key_health);
+
+	header = devm_kzalloc(module->dev, size, GFP_KERNEL);
+	if (!header)
+		return -ENOMEM;
+
+	header->magic = QMK_HEALTH_MAGIC;
+	header->version = QMK_HEALTH_VERSION;
+	header->entry_size = sizeof(struct qmk_key_health);
+	header->rows = keyboard->rows;
+	header->cols = keyboard->cols;
+
+	module->health_table = header;
+	module->health_size = size;
+	module->health = (struct qmk_key_health *)(header + 1);
+	module->health_activity_ns = ktime_get_ns();
+
+	return 0;
+}
+QMK_EXPORT_IF_KUNIT(qmk_health_init);
+
+/*
+ * Called with scan_lock held for every reported change. Replayed changes
+ * never happened on this hardware and are left out.
+ */
+void qmk_health_event(struct qmk_module *module, unsigned int row,
+		      unsigned int col, bool pressed, u64 now)
+{
+	struct qmk_key_health *health =
+		&module->health[row * module->keyboard->cols + col];
+
+	if (module->replaying)
+		return;
+
+	if (pressed)
+		health->presses++;
+	else
+		health->releases++;
+
+	health->last_change_ms = div_u64(now, NSEC_PER_MSEC);
+
+	module->health_activity_ns = now;
+	module->health_stuck_checked = false;
+}
+
+/* called with scan_lock held for every change held back by debounce */
+void qmk_health_bounce(struct qmk_module *module, unsigned int row,
+		       unsigned int col)
+{
+	struct qmk_key_health *health =
+		&module->health[row * module->keyboard->cols + col];
+
+	if (module->replaying)
+		return;
+
+	if (health->bounces != U16_MAX)
+		health->bounces++;
+}
+
+/*
+ * Called with scan_lock held after every scan without changes. Keys still
+ * held once the matrix has been quiet for stuck_ms are counted as stuck,
+ * once per quiet period, so the held keys are only walked once.
+ */
+void qmk_health_scan(struct qmk_module *module, u64 now)
+{
+	struct qmk_key_health *health;
+	unsigned int stuck_ms = module->pdata->stuck_ms;
+	unsigned int bit, row, col;
+
+	if (!stuck_ms || module->health_stuck_checked ||
+	    now - module->health_activity_ns < (u64)stuck_ms * NSEC_PER_MSEC)
+		return;
+
+	module->health_stuck_checked = true;
+
+	for_each_set_bit(bit, module->last_key_state, module->matrix_bits) {
+		col = bit >> module->col_shift;
+		row = bit & ((1 << module->col_shift) - 1);
+		health = &module->health[row * module->keyboard->cols + col];
+
+		if (health->stuck != U16_MAX)
+			health->stuck++;
+		dev_warn_ratelimited(module->dev,
+				     "key at row %u, col %u looks stuck\n",
+				     row, col);
+	}
+}
+
+ssize_t qmk_health_read(struct qmk_module *module, char *buf, loff_t off,
+			size_t count)
+{
+	ssize_t len;
+
+	mutex_lock(&module->scan_lock);
+	len = memory_read_from_buffer(buf, count, &off, module->health_table,
+				      module->health_size);
+	mutex_unlock(&module->scan_lock);
+
+	return len;
+}
+
+void qmk_health_reset(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+
+	mutex_lock(&module->scan_lock);
+	memset(module->health, 0,
+	       keyboard->rows * keyboard->cols * sizeof(*module->health));
+	module->health_stuck_checked = false;
+	mutex_unlock(&module->scan_lock);
+}
+
+MODULE_LICENSE("GPL");
@@ -20,6 +20,7 @@
  */
 
 #include <linux/device.h>
+#include <linux/err.h>
 #include <linux/export.h>
 #include <linux/gfp.h>
 #include <linux/input.h>
@@ -31,13 +32,13 @@
 #include <linux/types.h>
 #include "qmk_scancodes.h"
 
-static bool qmk_map_key(struct input_dev *input_dev, unsigned int layers,
-			unsigned int layer_shift, unsigned int rows,
-			unsigned int cols, unsigned int row_shift,
-			unsigned int key)
+QMK_VISIBLE_IF_KUNIT
+bool qmk_map_key(struct input_dev *input_dev, unsigned short *keymap,
+		 unsigned int layers, unsigned int layer_shift,
+		 unsigned int rows, unsigned int cols, unsigned int row_shift,
+		 unsigned int layer_base, unsigned int key)
 {
-	unsigned short *keymap = input_dev->keycode;
-	unsigned int layer = KEY_LAYER(key);
+	unsigned int layer = layer_base + KEY_LAYER(key);
 	unsigned int row = KEY_ROW(key);
 	unsigned int col = KEY_COL(key);
 	unsigned short code = KEY_VAL(key);
@@ -57,6 +58,7 @@ static bool qmk_map_key(struct input_dev *input_dev, unsigned int layers,
 
 	return true;
 }
+QMK_EXPORT_IF_KUNIT(qmk_map_key);
 
 /**
  * qmk_parse_properties() - Read properties of matrix keyboard
@@ -85,9 +87,11 @@ int qmk_parse_properties(struct device *dev, unsigned int *layers,
 	return 0;
 }
 
-static int qmk_parse_keymap(const char *propname, unsigned int layers,
-			    unsigned int rows, unsigned int cols,
-			    struct input_dev *input_dev)
+/* entries of @propname address layers from @layer_base up */
+static int qmk_parse_keys(const char *propname, unsigned int layer_base,
+			  unsigned int layers, unsigned int rows,
+			  unsigned int cols, unsigned short *keymap,
+			  struct input_dev *input_dev)
 {
 	struct device *dev = input_dev->dev.parent;
 	unsigned int row_shift = get_count_order(cols);
@@ -98,9 +102,6 @@ static int qmk_parse_keymap(const char *propname, unsigned int layers,
 	int size;
 	int retval;
 
-	if (!propname)
-		propname = "qmk,keymap";
-
 	size = device_property_read_u32_array(dev, propname, NULL, 0);
 	if (size <= 0) {
 		dev_err(dev, "missing or malformed property %s: %d\n", propname,
@@ -126,8 +127,8 @@ static int qmk_parse_keymap(const char *propname, unsigned int layers,
 	}
 
 	for (i = 0; i < size; i++) {
-		if (!qmk_map_key(input_dev, layers, layer_shift, rows, cols,
-				 row_shift, keys[i])) {
+		if (!qmk_map_key(input_dev, keymap, layers, layer_shift, rows,
+				 cols, row_shift, layer_base, keys[i])) {
 			retval = -EINVAL;
 			goto out;
 		}
@@ -140,6 +141,48 @@ out:
 	return retval;
 }
 
+/*
+ * KEY() only has four bits for the layer, so layers MATRIX_KEY_LAYERS and
+ * up are read from an optional second property named "<propname>-high",
+ * whose entries count their layers from MATRIX_KEY_LAYERS.
+ */
+QMK_VISIBLE_IF_KUNIT
+int qmk_parse_keymap(const char *propname, unsigned int layers,
+		     unsigned int rows, unsigned int cols,
+		     unsigned short *keymap, struct input_dev *input_dev)
+{
+	struct device *dev = input_dev->dev.parent;
+	char *high;
+	int retval;
+
+	if (!propname)
+		propname = "qmk,keymap";
+
+	retval = qmk_parse_keys(propname, 0, layers, rows, cols, keymap,
+				input_dev);
+	if (retval)
+		return retval;
+
+	high = kasprintf(GFP_KERNEL, "%s-high", propname);
+	if (!high)
+		return -ENOMEM;
+
+	if (device_property_present(dev, high)) {
+		if (layers <= MATRIX_KEY_LAYERS) {
+			dev_err(dev, "%s needs more than %d layers\n", high,
+				MATRIX_KEY_LAYERS);
+			retval = -EINVAL;
+		} else {
+			retval = qmk_parse_keys(high, MATRIX_KEY_LAYERS, layers,
+						rows, cols, keymap, input_dev);
+		}
+	}
+
+	kfree(high);
+	return retval;
+}
+QMK_EXPORT_IF_KUNIT(qmk_parse_keymap);
+
 /**
  * qmk_build_keymap - convert platform keymap into matrix keymap
  * @keymap_data: keymap supplied by the platform code
@@ -202,13 +245,14 @@ int qmk_build_keymap(const struct matrix_keymap_data *keymap_data,
 		for (i = 0; i < keymap_data->keymap_size; i++) {
 			unsigned int key = keymap_data->keymap[i];
 
-			if (!qmk_map_key(input_dev, layers, layer_shift, rows,
-					 cols, row_shift, key))
+			if (!qmk_map_key(input_dev, keymap, layers,
+					 layer_shift, rows, cols, row_shift, 0,
+					 key))
 				return -EINVAL;
 		}
 	} else {
 		error = qmk_parse_keymap(keymap_name, layers, rows, cols,
-					 input_dev);
+					 keymap, input_dev);
 		if (error)
 			return error;
 	}
@@ -217,5 +261,45 @@ int qmk_build_keymap(const struct matrix_keymap_data *keymap_data,
 
 	return 0;
 }
+QMK_EXPORT_IF_KUNIT(qmk_build_keymap);
+
+/**
+ * qmk_build_profile - convert a further device tree keymap
+ * @keymap_name: name of device tree property containing the keymap
+ * @layers: number of layers in target keymap array
+ * @rows: number of rows in target keymap array
+ * @cols: number of cols in target keymap array
+ * @input_dev: input device already set up by qmk_build_keymap()
+ *
+ * Builds another keymap laid out like the one in @input_dev->keycode, so
+ * either can be swapped in for the other. Keys it uses are added to the
+ * device's capabilities. The array is a managed block of memory of the
+ * parent device.
+ *
+ * Returns the keymap or an ERR_PTR() on error.
+ */
+unsigned short *qmk_build_profile(const char *keymap_name, unsigned int layers,
+				  unsigned int rows, unsigned int cols,
+				  struct input_dev *input_dev)
+{
+	unsigned short *keymap;
+	int error;
+
+	keymap = devm_kcalloc(input_dev->dev.parent, input_dev->keycodemax,
+			      sizeof(*keymap), GFP_KERNEL);
+	if (!keymap)
+		return ERR_PTR(-ENOMEM);
+
+	error = qmk_parse_keymap(keymap_name, layers, rows, cols, keymap,
+				 input_dev);
+	if (error) {
+		devm_kfree(input_dev->dev.parent, keymap);
+		return ERR_PTR(error);
+	}
+
+	__clear_bit(KEY_RESERVED, input_dev->keybit);
+
+	return keymap;
+}
 
 MODULE_LICENSE("GPL");
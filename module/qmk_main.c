@@ -13,6 +13,7 @@
  */
 
 #include "qmk.h"
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/gpio.h>
 #include <linux/input-polldev.h>
@@ -25,49 +26,154 @@
 #include <linux/of_platform.h>
 #include <linux/pinctrl/consumer.h>
 #include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/property.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <qmk/types.h>
 
+static struct dentry *qmk_debugfs_root;
+
+#define QMK_AUTOSUSPEND_DELAY_MS 2000
+
+static void qmk_scan_start(struct qmk_module *module)
+{
+	struct input_polled_dev *poll_dev = module->poll_dev;
+
+	mutex_lock(&module->scan_lock);
+	qmk_params_apply(module);
+	mutex_unlock(&module->scan_lock);
+
+	module->stopped = false;
+	module->scan_due_ns = 0;
+	module->settle_us = module->scan_params.col_scan_delay_us;
+	qmk_governor_reset(module);
+
+	qmk_encoder_start(module);
+	qmk_analog_start(module);
+
+	/* direct pins are scanned from their interrupts, never polled */
+	if (module->pdata->direct_pins) {
+		poll_dev->poll_interval = 0;
+		qmk_direct_start(module);
+		return;
+	}
+
+	/*
+	 * input-polldev only starts polling after this returns if
+	 * poll_interval is non-zero, so the scan thread takes over by
+	 * clearing it.
+	 */
+	if (module->scan_thread && !qmk_thread_start(module)) {
+		poll_dev->poll_interval = 0;
+		return;
+	}
+
+	poll_dev->poll_interval = module->governor.interval;
+}
+
+static void qmk_scan_stop(struct qmk_module *module)
+{
+	qmk_encoder_stop(module);
+	qmk_analog_stop(module);
+	if (module->pdata->direct_pins)
+		qmk_direct_stop(module);
+	qmk_thread_stop(module);
+	module->stopped = true;
+}
+
+/*
+ * The device is runtime-active for as long as the input device is open,
+ * and autosuspends shortly after the last user goes away.
+ */
 static void qmk_start(struct input_polled_dev *poll_dev)
 {
-	// struct qmk_module *keyboard = poll_dev->private;
-	// const struct qmk_platform_data *pdata = keyboard->pdata;
+	struct qmk_module *module = poll_dev->private;
 
-	// if (pdata->enable)
-	//     pdata->enable(keyboard->dev);
+	pm_runtime_get_sync(module->dev);
+	qmk_scan_start(module);
 }
 
 static void qmk_stop(struct input_polled_dev *poll_dev)
 {
-	// struct qmk_module *keyboard = poll_dev->private;
-	// const struct qmk_platform_data *pdata = keyboard->pdata;
+	struct qmk_module *module = poll_dev->private;
+
+	qmk_scan_stop(module);
+	pm_runtime_mark_last_busy(module->dev);
+	pm_runtime_put_autosuspend(module->dev);
+}
+
+#ifdef CONFIG_PM
+static int qmk_runtime_suspend(struct device *dev)
+{
+	struct qmk_module *module = dev_get_drvdata(dev);
+	const struct qmk_platform_data *pdata = module->pdata;
+
+	qmk_idle_gpio(module);
+
+	if (pdata->disable)
+		pdata->disable(dev);
+
+	return 0;
+}
+
+static int qmk_runtime_resume(struct device *dev)
+{
+	struct qmk_module *module = dev_get_drvdata(dev);
+	const struct qmk_platform_data *pdata = module->pdata;
+
+	if (pdata->enable)
+		return pdata->enable(dev);
 
-	// if (pdata->disable)
-	//     pdata->disable(keyboard->dev);
+	return 0;
 }
+#endif
 
 #ifdef CONFIG_PM_SLEEP
-static void qmk_enable_wakeup(struct qmk_module *keyboard)
+/*
+ * All strobe lines are driven active while suspended, so any key press
+ * asserts its sense line and fires that line's wakeup interrupt.
+ */
+static void qmk_enable_wakeup(struct qmk_module *module)
 {
-	// const struct qmk_platform_data *pdata = keyboard->pdata;
-	// unsigned int gpio;
-	// int i;
+	unsigned int irq;
+	int i;
+
+	qmk_arm_gpio(module);
+
+	for (i = 0; i < module->num_sense; i++) {
+		irq = gpio_to_irq(module->sense_gpios[i]);
+		enable_irq(irq);
+		if (enable_irq_wake(irq) == 0)
+			__set_bit(i, module->wake_gpios);
+	}
 }
 
-static void qmk_disable_wakeup(struct qmk_module *keyboard)
+static void qmk_disable_wakeup(struct qmk_module *module)
 {
-	// const struct qmk_platform_data *pdata = keyboard->pdata;
-	// unsigned int gpio;
-	// int i;
+	unsigned int irq;
+	int i;
+
+	for (i = 0; i < module->num_sense; i++) {
+		irq = gpio_to_irq(module->sense_gpios[i]);
+		if (__test_and_clear_bit(i, module->wake_gpios))
+			disable_irq_wake(irq);
+		disable_irq(irq);
+	}
+
+	qmk_idle_gpio(module);
 }
 
 static int qmk_suspend(struct device *dev)
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct qmk_module *module = platform_get_drvdata(pdev);
+	struct input_dev *input = module->input_dev;
 
-	qmk_stop(module->input_dev);
+	mutex_lock(&input->mutex);
+	if (input->users)
+		qmk_scan_stop(module);
+	mutex_unlock(&input->mutex);
 
 	if (device_may_wakeup(&pdev->dev))
 		qmk_enable_wakeup(module);
@@ -79,26 +185,64 @@ static int qmk_resume(struct device *dev)
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct qmk_module *module = platform_get_drvdata(pdev);
+	struct input_dev *input = module->input_dev;
 
 	if (device_may_wakeup(&pdev->dev))
 		qmk_disable_wakeup(module);
 
-	qmk_start(module->input_dev);
+	mutex_lock(&input->mutex);
+	if (input->users)
+		qmk_scan_start(module);
+	mutex_unlock(&input->mutex);
 
 	return 0;
 }
 #endif
 
-static SIMPLE_DEV_PM_OPS(qmk_pm_ops, qmk_suspend, qmk_resume);
+static const struct dev_pm_ops qmk_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(qmk_suspend, qmk_resume)
+	SET_RUNTIME_PM_OPS(qmk_runtime_suspend, qmk_runtime_resume, NULL)
+};
 
 #ifdef CONFIG_OF
+/*
+ * Analog thresholds are given either once for every key or once per key,
+ * in row-major order.
+ */
+static u32 *qmk_parse_analog_points(struct device *dev, const char *propname,
+				    unsigned int keys)
+{
+	struct device_node *np = dev->of_node;
+	u32 *points;
+	int i, n;
+
+	n = of_property_count_u32_elems(np, propname);
+	if (n != 1 && n != keys) {
+		dev_err(dev, "%s needs 1 or %u values\n", propname, keys);
+		return ERR_PTR(-EINVAL);
+	}
+
+	points = devm_kcalloc(dev, keys, sizeof(u32), GFP_KERNEL);
+	if (!points)
+		return ERR_PTR(-ENOMEM);
+
+	of_property_read_u32_array(np, propname, points, n);
+	for (i = n; i < keys; i++)
+		points[i] = points[0];
+
+	return points;
+}
+
 static struct qmk_platform_data *qmk_parse_dt(struct device *dev,
 					      struct qmk_keyboard *keyboard)
 {
 	struct qmk_platform_data *pdata;
 	struct device_node *np = dev->of_node;
 	unsigned int *gpios;
-	int ret, i, nrow, ncol;
+	u32 *keys;
+	const char *strobe;
+	int ret, i, nrow, ncol, ncpu, nkeys;
+	u32 cpu;
 
 	if (!np) {
 		dev_err(dev, "device lacks DT data\n");
@@ -113,17 +257,35 @@ static struct qmk_platform_data *qmk_parse_dt(struct device *dev,
 
 	of_property_read_string(np, "device-name", &pdata->name);
 	of_property_read_u32(np, "keypad,num-layers", &keyboard->layers);
-	if (keyboard->layers <= 0) {
+	if (keyboard->layers <= 0 || keyboard->layers > MATRIX_MAX_LAYERS) {
 		dev_err(dev, "number of keyboard layers not specified\n");
 		return ERR_PTR(-EINVAL);
 	}
-	keyboard->rows = nrow = of_gpio_named_count(np, "row-gpios");
-	if (nrow <= 0) {
-		dev_err(dev, "number of keyboard rows not specified\n");
-		return ERR_PTR(-EINVAL);
+
+	pdata->direct_pins = of_property_read_bool(np, "qmk,direct-pins");
+	pdata->analog = of_property_read_bool(np, "qmk,analog");
+	if (pdata->direct_pins) {
+		/* every key sits on the single row, one column per gpio */
+		keyboard->rows = 1;
+		nrow = 0;
+	} else if (pdata->analog) {
+		/* rows are sensed through ADC channels instead of gpios */
+		keyboard->rows = of_count_phandle_with_args(
+			np, "io-channels", "#io-channel-cells");
+		if (keyboard->rows <= 0 || keyboard->rows > MATRIX_MAX_ROWS) {
+			dev_err(dev, "number of analog rows not specified\n");
+			return ERR_PTR(-EINVAL);
+		}
+		nrow = 0;
+	} else {
+		keyboard->rows = nrow = of_gpio_named_count(np, "row-gpios");
+		if (nrow <= 0 || nrow > MATRIX_MAX_ROWS) {
+			dev_err(dev, "number of keyboard rows not specified\n");
+			return ERR_PTR(-EINVAL);
+		}
 	}
 	keyboard->cols = ncol = of_gpio_named_count(np, "col-gpios");
-	if (ncol <= 0) {
+	if (ncol <= 0 || ncol > MATRIX_MAX_COLS) {
 		dev_err(dev, "number of keyboard columns not specified\n");
 		return ERR_PTR(-EINVAL);
 	}
@@ -132,21 +294,72 @@ static struct qmk_platform_data *qmk_parse_dt(struct device *dev,
 		pdata->no_autorepeat = true;
 
 	of_property_read_u32(np, "poll-interval", &pdata->poll_interval);
+	of_property_read_u32(np, "qmk,scan-interval-max-ms",
+			     &pdata->scan_interval_max);
+	pdata->idle_scans = QMK_IDLE_SCANS_DEFAULT;
+	of_property_read_u32(np, "qmk,scan-idle-scans", &pdata->idle_scans);
+	pdata->stuck_ms = QMK_STUCK_MS_DEFAULT;
+	of_property_read_u32(np, "qmk,stuck-key-ms", &pdata->stuck_ms);
+	of_property_read_string(np, "qmk,keymap-firmware",
+				&pdata->keymap_firmware);
 
 	pdata->wakeup = of_property_read_bool(np, "wakeup-source") ||
 			of_property_read_bool(np, "linux,wakeup"); /* legacy */
+	/* keys wake the system through their sense gpios, analog has none */
+	if (pdata->wakeup && pdata->analog) {
+		dev_err(dev, "wakeup-source is not supported with analog rows\n");
+		return ERR_PTR(-EINVAL);
+	}
 
 	if (of_get_property(np, "gpio-activelow", NULL))
 		pdata->active_low = true;
 
 	pdata->drive_inactive_cols =
 		of_property_read_bool(np, "drive-inactive-cols");
+	pdata->anti_ghost = of_property_read_bool(np, "qmk,anti-ghost");
+
+	if (!of_property_read_string(np, "qmk,strobe-lines", &strobe)) {
+		if (!strcmp(strobe, "rows"))
+			pdata->strobe = QMK_STROBE_ROWS;
+		else if (!strcmp(strobe, "auto"))
+			pdata->strobe = QMK_STROBE_AUTO;
+		else if (strcmp(strobe, "cols"))
+			dev_warn(dev, "unknown strobe-lines \"%s\"\n", strobe);
+	}
 
 	of_property_read_u32(np, "debounce-delay-ms", &pdata->debounce_ms);
+	pdata->debounce_adaptive =
+		of_property_read_bool(np, "qmk,debounce-adaptive");
+	of_property_read_u32(np, "qmk,debounce-min-us",
+			     &pdata->debounce_min_us);
+	pdata->debounce_max_us = QMK_DEBOUNCE_MAX_US_DEFAULT;
+	of_property_read_u32(np, "qmk,debounce-max-us",
+			     &pdata->debounce_max_us);
 	of_property_read_u32(np, "col-scan-delay-us",
 			     &pdata->col_scan_delay_us);
+	pdata->overrun_degrade =
+		of_property_read_bool(np, "qmk,overrun-degrade");
+
+	pdata->scan_thread = of_property_read_bool(np, "qmk,scan-thread");
+	pdata->scan_priority = QMK_SCAN_PRIORITY_DEFAULT;
+	of_property_read_u32(np, "qmk,scan-priority", &pdata->scan_priority);
+	if (pdata->scan_priority < 1 ||
+	    pdata->scan_priority > MAX_USER_RT_PRIO - 1) {
+		dev_warn(dev, "invalid scan priority %u, using %u\n",
+			 pdata->scan_priority, QMK_SCAN_PRIORITY_DEFAULT);
+		pdata->scan_priority = QMK_SCAN_PRIORITY_DEFAULT;
+	}
+
+	ncpu = of_property_count_u32_elems(np, "qmk,scan-cpus");
+	for (i = 0; i < ncpu; i++) {
+		of_property_read_u32_index(np, "qmk,scan-cpus", i, &cpu);
+		if (cpu < nr_cpu_ids)
+			cpumask_set_cpu(cpu, &pdata->scan_cpus);
+	}
+	if (cpumask_empty(&pdata->scan_cpus))
+		cpumask_copy(&pdata->scan_cpus, cpu_possible_mask);
 
-	gpios = devm_kcalloc(dev, keyboard->rows + keyboard->cols,
+	gpios = devm_kcalloc(dev, nrow + ncol,
 			     sizeof(unsigned int), GFP_KERNEL);
 	if (!gpios) {
 		dev_err(dev, "could not allocate memory for gpios\n");
@@ -167,8 +380,58 @@ static struct qmk_platform_data *qmk_parse_dt(struct device *dev,
 		gpios[nrow + i] = ret;
 	}
 
-	pdata->row_gpios = gpios;
-	pdata->col_gpios = &gpios[keyboard->rows];
+	pdata->row_gpios = nrow ? gpios : NULL;
+	pdata->col_gpios = &gpios[nrow];
+
+	if (pdata->analog) {
+		pdata->analog_actuation = qmk_parse_analog_points(
+			dev, "qmk,analog-actuation", keyboard->rows * ncol);
+		if (IS_ERR(pdata->analog_actuation))
+			return ERR_CAST(pdata->analog_actuation);
+
+		pdata->analog_release = qmk_parse_analog_points(
+			dev, "qmk,analog-release", keyboard->rows * ncol);
+		if (IS_ERR(pdata->analog_release))
+			return ERR_CAST(pdata->analog_release);
+
+		of_property_read_u32(np, "qmk,analog-rapid-trigger",
+				     &pdata->analog_rapid_trigger);
+	}
+
+	/* each encoder takes an A/B gpio pair and a cw/ccw keycode pair */
+	nkeys = of_property_count_u32_elems(np, "qmk,encoder-keys");
+	if (nkeys > 0) {
+		if (nkeys % 2 ||
+		    of_gpio_named_count(np, "qmk,encoder-gpios") != nkeys) {
+			dev_err(dev, "encoder gpios and keys do not pair up\n");
+			return ERR_PTR(-EINVAL);
+		}
+
+		gpios = devm_kcalloc(dev, nkeys, sizeof(unsigned int),
+				     GFP_KERNEL);
+		keys = devm_kcalloc(dev, nkeys, sizeof(u32), GFP_KERNEL);
+		if (!gpios || !keys) {
+			dev_err(dev, "could not allocate memory for encoders\n");
+			return ERR_PTR(-ENOMEM);
+		}
+
+		for (i = 0; i < nkeys; i++) {
+			ret = of_get_named_gpio(np, "qmk,encoder-gpios", i);
+			if (ret < 0)
+				return ERR_PTR(ret);
+			gpios[i] = ret;
+		}
+		of_property_read_u32_array(np, "qmk,encoder-keys", keys, nkeys);
+
+		pdata->encoder_gpios = gpios;
+		pdata->encoder_keys = keys;
+		pdata->num_encoders = nkeys / 2;
+		pdata->encoder_resolution = QMK_ENCODER_RESOLUTION_DEFAULT;
+		of_property_read_u32(np, "qmk,encoder-resolution",
+				     &pdata->encoder_resolution);
+		of_property_read_u32(np, "qmk,encoder-accel-ms",
+				     &pdata->encoder_accel_ms);
+	}
 
 	return pdata;
 }
@@ -182,6 +445,8 @@ qmk_parse_dt(struct device *dev, struct qmk_keyboard *keyboard)
 }
 #endif
 
+static const struct matrix_keymap_data qmk_empty_keymap;
+
 static int qmk_probe(struct platform_device *pdev)
 {
 	struct device *dev = &pdev->dev;
@@ -190,7 +455,9 @@ static int qmk_probe(struct platform_device *pdev)
 	struct qmk_keyboard *keyboard;
 	struct input_polled_dev *poll_dev;
 	struct input_dev *input;
+	const struct matrix_keymap_data *pdata_keymap;
 	size_t size;
+	bool wakeup;
 	int err;
 
 	size = sizeof(struct qmk_keyboard);
@@ -208,10 +475,24 @@ static int qmk_probe(struct platform_device *pdev)
 			err = PTR_ERR(pdata);
 			goto err_free_keyboard;
 		}
-	} else if (!pdata->keymap_data) {
+	} else if (!pdata->keymap_data && !pdata->keymap_bin &&
+		   !pdata->keymap_firmware) {
 		dev_err(dev, "no keymap data defined\n");
 		err = -EINVAL;
 		goto err_free_keyboard;
+	} else {
+		keyboard->layers = pdata->num_layers;
+		keyboard->rows = pdata->num_row_gpios;
+		keyboard->cols = pdata->num_col_gpios;
+		if (!keyboard->layers || keyboard->layers > MATRIX_MAX_LAYERS ||
+		    !keyboard->rows || keyboard->rows > MATRIX_MAX_ROWS ||
+		    !keyboard->cols || keyboard->cols > MATRIX_MAX_COLS) {
+			dev_err(dev, "invalid matrix of %ux%ux%u\n",
+				keyboard->layers, keyboard->rows,
+				keyboard->cols);
+			err = -EINVAL;
+			goto err_free_keyboard;
+		}
 	}
 
 	size = sizeof(struct qmk_module);
@@ -246,7 +527,15 @@ static int qmk_probe(struct platform_device *pdev)
 	// input->open             = qmk_start;
 	// input->close            = qmk_stop;
 
-	err = qmk_build_keymap(pdata->keymap_data, "qmk,keymap",
+	/* a keymap loaded as a blob or firmware makes the built-in one optional */
+	if (!pdata->keymap_data &&
+	    (pdata->keymap_bin || (pdata->keymap_firmware &&
+				   !device_property_present(dev, "qmk,keymap"))))
+		pdata_keymap = &qmk_empty_keymap;
+	else
+		pdata_keymap = pdata->keymap_data;
+
+	err = qmk_build_keymap(pdata_keymap, "qmk,keymap",
 			       keyboard->layers, keyboard->rows, keyboard->cols,
 			       NULL, input);
 	if (err) {
@@ -256,10 +545,14 @@ static int qmk_probe(struct platform_device *pdev)
 
 	poll_dev->private = module;
 	poll_dev->poll = qmk_scan;
-	poll_dev->poll_interval = pdata->poll_interval;
+	poll_dev->poll_interval = pdata->poll_interval ?:
+				  QMK_POLL_INTERVAL_DEFAULT;
 	poll_dev->open = qmk_start;
 	poll_dev->close = qmk_stop;
 
+	/* every layer has to have a bit in libqmk's layer state */
+	BUILD_BUG_ON(sizeof(keyboard->layer_state) * BITS_PER_BYTE <
+		     MATRIX_MAX_LAYERS);
 	keyboard->keymap = input->keycode;
 	keyboard->layer_state = 1;
 
@@ -276,17 +569,97 @@ static int qmk_probe(struct platform_device *pdev)
 	module->layer_shift =
 		get_count_order(keyboard->rows << module->row_shift);
 	module->stopped = true;
+	mutex_init(&module->scan_lock);
+	mutex_init(&module->thread_lock);
+	qmk_governor_init(module, poll_dev->poll_interval,
+			  pdata->scan_interval_max, pdata->idle_scans);
+	qmk_params_init(module);
+	module->anti_ghost = pdata->anti_ghost;
+	module->settle_us = pdata->col_scan_delay_us;
+	module->scan_thread = pdata->scan_thread;
+	module->scan_priority = pdata->scan_priority;
+	cpumask_copy(&module->scan_cpus, &pdata->scan_cpus);
+
+	err = qmk_alloc_matrix(module);
+	if (err) {
+		dev_err(dev, "no memory for matrix state\n");
+		goto err_free_device;
+	}
+
+	err = qmk_health_init(module);
+	if (err) {
+		dev_err(dev, "no memory for key health\n");
+		goto err_free_device;
+	}
+
+	err = qmk_effective_init(module);
+	if (err) {
+		dev_err(dev, "no memory for effective keymap\n");
+		goto err_free_device;
+	}
+
+	err = qmk_reload_init(module);
+	if (err) {
+		dev_err(dev, "unable to init keymap reload, err=%d\n", err);
+		goto err_free_device;
+	}
+
+	module->debugfs = debugfs_create_dir(dev_name(dev), qmk_debugfs_root);
+
+	err = qmk_capture_init(module);
+	if (err) {
+		dev_err(dev, "unable to init capture, err=%d\n", err);
+		goto err_free_debugfs;
+	}
+
+	err = qmk_debounce_init(module);
+	if (err) {
+		dev_err(dev, "no memory for debounce state\n");
+		goto err_free_capture;
+	}
+
+	qmk_setup_strobe(module);
+
+	err = qmk_analog_init(module);
+	if (err) {
+		dev_err(dev, "unable to init analog rows, err=%d\n", err);
+		goto err_free_capture;
+	}
 
 	err = qmk_init_gpio(pdev, module);
 	if (err) {
 		dev_err(dev, "unable to init gpio, err=%d\n", err);
-		goto err_free_device;
+		goto err_free_capture;
 	}
 
+	err = qmk_encoder_init(module);
+	if (err) {
+		dev_err(dev, "unable to init encoders, err=%d\n", err);
+		goto err_free_gpio;
+	}
+
+	wakeup = pdata->wakeup;
+	if (wakeup) {
+		err = qmk_init_wakeup(module);
+		if (err) {
+			dev_warn(dev, "no wakeup interrupts, err=%d\n", err);
+			wakeup = false;
+		}
+	}
+
+	platform_set_drvdata(pdev, module);
+	qmk_dump_init(module);
+
+	pm_runtime_set_active(dev);
+	pm_runtime_get_noresume(dev);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_set_autosuspend_delay(dev, QMK_AUTOSUSPEND_DELAY_MS);
+	pm_runtime_enable(dev);
+
 	err = sysfs_create_group(&pdev->dev.kobj, get_qmk_group());
 	if (err) {
 		dev_err(dev, "sysfs creation failed\n");
-		goto err_free_gpio;
+		goto err_disable_pm;
 	}
 
 	err = input_register_polled_device(poll_dev);
@@ -295,15 +668,34 @@ static int qmk_probe(struct platform_device *pdev)
 		goto err_free_sysfs;
 	}
 
-	device_init_wakeup(dev, pdata->wakeup);
-	platform_set_drvdata(pdev, module);
+	device_init_wakeup(dev, wakeup);
+
+	err = qmk_reload_request(module);
+	if (err)
+		dev_warn(dev, "unable to request keymap %s, err=%d\n",
+			 pdata->keymap_firmware, err);
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
 
 	return 0;
 
 err_free_sysfs:
 	sysfs_remove_group(&pdev->dev.kobj, get_qmk_group());
+err_disable_pm:
+	qmk_dump_exit(module);
+	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_put_noidle(dev);
+	pm_runtime_set_suspended(dev);
+	qmk_encoder_exit(module);
 err_free_gpio:
 	qmk_free_gpio(module);
+err_free_capture:
+	qmk_capture_exit(module);
+err_free_debugfs:
+	debugfs_remove_recursive(module->debugfs);
+	qmk_reload_exit(module);
 err_free_device:
 	input_free_polled_device(poll_dev);
 err_free_module:
@@ -319,12 +711,23 @@ static int qmk_remove(struct platform_device *pdev)
 	struct qmk_module *module = platform_get_drvdata(pdev);
 	struct device *dev = &pdev->dev;
 
-	qmk_free_gpio(module);
+	sysfs_remove_group(&pdev->dev.kobj, get_qmk_group());
+	qmk_dump_exit(module);
+
+	/* a keymap still loading would land on a freed input device */
+	wait_for_completion(&module->keymap_firmware_done);
 	input_unregister_polled_device(module->poll_dev);
+	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_set_suspended(dev);
+	device_init_wakeup(dev, false);
+	qmk_encoder_exit(module);
+	qmk_free_gpio(module);
+	qmk_capture_exit(module);
+	debugfs_remove_recursive(module->debugfs);
+	qmk_reload_exit(module);
 	devm_kfree(dev, module);
 
-	sysfs_remove_group(&pdev->dev.kobj, get_qmk_group());
-
 	return 0;
 }
 
@@ -351,13 +754,29 @@ static int __init qmk_driver_init(void)
 	int status;
 	status = gadget_init();
 
+	qmk_debugfs_root = debugfs_create_dir("qmk", NULL);
+
+	/* keyboards may probe and start scanning as soon as it's registered */
+	status = qmk_protocol_init();
+	if (status)
+		goto err_free_gadget;
+
 	status = platform_driver_register(&qmk_driver);
     if (status)
-       goto err_free_gadget;
+       goto err_protocol_exit;
+
+	status = qmk_configfs_init();
+	if (status)
+		goto err_unregister_driver;
 
     return status;
 
+err_unregister_driver:
+	platform_driver_unregister(&qmk_driver);
+err_protocol_exit:
+	qmk_protocol_exit();
 err_free_gadget:
+	debugfs_remove_recursive(qmk_debugfs_root);
 	gadget_exit();
 
 	return status;
@@ -365,7 +784,10 @@ err_free_gadget:
 
 static void __exit qmk_driver_exit(void)
 {
+	qmk_configfs_exit();
 	platform_driver_unregister(&qmk_driver);
+	qmk_protocol_exit();
+	debugfs_remove_recursive(qmk_debugfs_root);
 	gadget_exit();
 }
 
@@ -0,0 +1,115 @@
+/*
+ * Scan parameters tunable at runtime
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/preempt.h>
+#include <linux/seqlock.h>
+
+/*
+ * Writers serialize on params_lock and change params inside a params_seq
+ * write section. The scan never takes params_lock: at its start it
+ * compares params_seq with the count it last applied, and only when they
+ * differ copies params into scan_params and applies what changed. A copy
+ * that raced with a writer fails read_seqcount_retry() and is left for the
+ * next scan, so the scan never spins on a writer.
+ */
+
+void qmk_params_init(struct qmk_module *module)
+{
+	const struct qmk_platform_data *pdata = module->pdata;
+	struct qmk_scan_params *params = &module->params;
+
+	mutex_init(&module->params_lock);
+	seqcount_init(&module->params_seq);
+
+	params->poll_interval = module->governor.min_interval;
+	params->scan_interval_max = pdata->scan_interval_max;
+	params->idle_scans = pdata->idle_scans;
+	params->col_scan_delay_us = pdata->col_scan_delay_us;
+	params->debounce_ms = pdata->debounce_ms;
+	params->drive_inactive_cols = pdata->drive_inactive_cols;
+	params->active_low = pdata->active_low;
+
+	module->params_applied = raw_read_seqcount(&module->params_seq);
+	module->scan_params = *params;
+}
+
+/* the latest settings, applied or not */
+void qmk_params_read(struct qmk_module *module, struct qmk_scan_params *params)
+{
+	mutex_lock(&module->params_lock);
+	*params = module->params;
+	mutex_unlock(&module->params_lock);
+}
+
+/*
+ * Returns the settings to change, which are published by
+ * qmk_params_commit(). Preemption stays off in between, so only assign.
+ */
+struct qmk_scan_params *qmk_params_begin(struct qmk_module *module)
+{
+	mutex_lock(&module->params_lock);
+	preempt_disable();
+	write_seqcount_begin(&module->params_seq);
+
+	return &module->params;
+}
+
+void qmk_params_commit(struct qmk_module *module)
+{
+	write_seqcount_end(&module->params_seq);
+	preempt_enable();
+	mutex_unlock(&module->params_lock);
+}
+
+/* called with scan_lock held before every scan */
+void qmk_params_apply(struct qmk_module *module)
+{
+	struct qmk_scan_params params, *old = &module->scan_params;
+	unsigned int seq;
+
+	/* orders the copy after the count, like read_seqcount_begin() */
+	seq = raw_read_seqcount(&module->params_seq);
+	if (seq == module->params_applied || (seq & 1))
+		return;
+
+	params = module->params;
+	if (read_seqcount_retry(&module->params_seq, seq))
+		return;
+
+	if (params.poll_interval != old->poll_interval ||
+	    params.scan_interval_max != old->scan_interval_max ||
+	    params.idle_scans != old->idle_scans)
+		__qmk_governor_init(module, params.poll_interval,
+				    params.scan_interval_max,
+				    params.idle_scans);
+
+	if (params.col_scan_delay_us != old->col_scan_delay_us)
+		module->settle_us = params.col_scan_delay_us;
+
+	if (params.debounce_ms != old->debounce_ms)
+		qmk_debounce_set(module, params.debounce_ms);
+
+	if (params.active_low != old->active_low)
+		qmk_set_polarity(module, params.active_low);
+
+	module->scan_params = params;
+	module->params_applied = seq;
+}
+
+MODULE_LICENSE("GPL");
@@ -1,9 +1,11 @@
 #include <linux/timer.h>
 #include <qmk/protocol.h>
 #include <linux/input.h>
+#include <linux/kernel.h>
 #include <linux/printk.h>
 #include "qmk_scancodes.h"
 #include "qmk.h"
+#include "qmk_dispatch.h"
 #include "qmk_socket.h"
 
 static bool usb_passthrough = false;
@@ -30,31 +32,79 @@ void send_keycode(struct qmk_keyboard *keyboard, hid_keycode_t keycode,
 		queue_socket_message((uint8_t[]){ KEYCODE_HID, keycode, pressed }, 3);
 	} else {
 		scancode = keycode_to_scancode[keycode];
+		input_event(input, EV_MSC, MSC_SCAN,
+			    module->event_scancode != QMK_SCANCODE_NONE ?
+				    module->event_scancode :
+				    scancode);
 		input_report_key(input, scancode, pressed);
-		input_event(input, EV_MSC, MSC_SCAN, scancode);
 	}
 }
 
-bool process_qkm(struct qmk_keyboard *keyboard, qmk_keycode_t *keycode,
-		 bool pressed)
+static bool qmk_usb_passthrough_process(struct qmk_keyboard *keyboard,
+					u16 keycode, bool pressed, void *data)
 {
-	if (*keycode == 0xFFF1) {
-		if (pressed) {
-			if (usb_passthrough) {
-				printk("Disabling USB Passthrough");
-				usb_passthrough = false;
-				// queue_socket_message_f("%c%s", MSG_GENERIC, "USB Passthrough Disabled");
-			} else {
-				printk("Enabling USB Passthrough");
-				// queue_socket_message_f("%c%s", MSG_GENERIC, "USB Passthrough Enabled");
-				usb_passthrough = true;
-			}
-			queue_socket_message((uint8_t[]){ USB_PASSTHROUGH, usb_passthrough }, 2);
-		}
-		return true;
+	struct qmk_module *module = keyboard->parent;
+
+	/* the USB_PASSTHROUGH message is what tells userspace */
+	if (pressed) {
+		usb_passthrough = !usb_passthrough;
+		dev_dbg_ratelimited(module->dev, "USB passthrough %s\n",
+				    usb_passthrough ? "enabled" : "disabled");
+		queue_socket_message((uint8_t[]){ USB_PASSTHROUGH, usb_passthrough }, 2);
+	}
+	return true;
+}
+
+static bool qmk_profile_process(struct qmk_keyboard *keyboard, u16 keycode,
+				bool pressed, void *data)
+{
+	struct qmk_module *module = keyboard->parent;
+
+	if (pressed && qmk_profile_select(module, keycode - QMK_KC_PROFILE))
+		dev_dbg_ratelimited(module->dev, "no keymap in profile %d\n",
+				    keycode - QMK_KC_PROFILE);
+	return true;
+}
+
+static const struct qmk_keycode_handler qmk_builtin_keycodes[] = {
+	{
+		.first = QMK_KC_USB_PASSTHROUGH,
+		.last = QMK_KC_USB_PASSTHROUGH,
+		.process = qmk_usb_passthrough_process,
+	},
+	{
+		.first = QMK_KC_PROFILE,
+		.last = QMK_KC_PROFILE + QMK_MAX_PROFILES - 1,
+		.process = qmk_profile_process,
+	},
+};
+
+/* registers the keycodes handled by the module itself */
+int qmk_protocol_init(void)
+{
+	int i, err;
+
+	for (i = 0; i < ARRAY_SIZE(qmk_builtin_keycodes); i++) {
+		err = qmk_register_keycodes(&qmk_builtin_keycodes[i]);
+		if (err)
+			goto err_unregister;
 	}
 
-	return false;
+	return 0;
+
+err_unregister:
+	while (--i >= 0)
+		qmk_unregister_keycodes(&qmk_builtin_keycodes[i]);
+	return err;
+}
+
+void qmk_protocol_exit(void)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(qmk_builtin_keycodes) - 1; i >= 0; i--)
+		qmk_unregister_keycodes(&qmk_builtin_keycodes[i]);
+	qmk_dispatch_exit();
 }
 
 const struct qmk_protocol protocol = {
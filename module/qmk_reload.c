@@ -0,0 +1,617 @@
+/*
+ * Keymap reload without reloading the module
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include "qmk_keymap.h"
+#include "qmk_socket.h"
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include <linux/firmware.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/property.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+#include <qmk/keycodes/basic.h>
+#include "qmk_scancodes.h"
+
+/*
+ * A keymap arrives as one blob, possibly split over several writes. Once
+ * complete it is checked and expanded into a new table while the scan
+ * carries on with the old one, then published with a single pointer swap.
+ * Scans read the table inside an SRCU read section (reporting a key can
+ * sleep in netlink), so the old table is freed once every scan that might
+ * still use it has finished.
+ * Keys held across a swap come up as what they were pressed as, see
+ * qmk_effective_release(). A blob may have fewer layers than the keyboard;
+ * the layers above it are transparent, so turning one on changes nothing.
+ *
+ * Up to QMK_MAX_PROFILES keymaps stay resident in sparse form, see
+ * qmk_sparse.c. Each blob names the profile it replaces and only the
+ * active one is also published. Switching profile expands the new one into
+ * a fresh table and publishes that; the table replaced is handed to
+ * call_srcu(), so nothing waits for the scans and a keycode may switch.
+ */
+
+/**
+ * struct qmk_live_keymap - keymap in the padded layout, as used by scans
+ * @rcu: retires the table once no scan uses it
+ * @keycodes: input_dev->keycodemax entries, see QMK_MATRIX_SCAN_CODE()
+ */
+struct qmk_live_keymap {
+	struct rcu_head rcu;
+	unsigned short keycodes[];
+};
+
+static u32 qmk_reload_crc(const void *data, size_t len)
+{
+	/* same as zlib's crc32(), so tools can use that */
+	return crc32_le(~0, data, len) ^ ~0;
+}
+
+static int qmk_reload_check(struct qmk_module *module,
+			    const struct qmk_keymap_header *header)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int layers = le16_to_cpu(header->layers);
+	unsigned int rows = le16_to_cpu(header->rows);
+	unsigned int cols = le16_to_cpu(header->cols);
+	unsigned int profile = le16_to_cpu(header->profile);
+
+	if (le32_to_cpu(header->magic) != QMK_KEYMAP_MAGIC ||
+	    le16_to_cpu(header->version) != QMK_KEYMAP_VERSION ||
+	    header->reserved) {
+		dev_err(module->dev, "not a version %d keymap\n",
+			QMK_KEYMAP_VERSION);
+		return -EINVAL;
+	}
+
+	if (profile >= QMK_MAX_PROFILES) {
+		dev_err(module->dev, "no profile %u, at most %d\n", profile,
+			QMK_MAX_PROFILES);
+		return -EINVAL;
+	}
+
+	if (!layers || layers > keyboard->layers || rows != keyboard->rows ||
+	    cols != keyboard->cols) {
+		dev_err(module->dev,
+			"keymap is %ux%ux%u, keyboard is %ux%ux%u\n", layers,
+			rows, cols, keyboard->layers, keyboard->rows,
+			keyboard->cols);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* size of the keymap @header starts, once checked */
+static size_t qmk_reload_size(const struct qmk_keymap_header *header)
+{
+	return QMK_KEYMAP_SIZE(le16_to_cpu(header->layers),
+			       le16_to_cpu(header->rows),
+			       le16_to_cpu(header->cols));
+}
+
+static struct qmk_live_keymap *qmk_live_alloc(struct qmk_module *module)
+{
+	struct qmk_live_keymap *live;
+
+	return kvzalloc(struct_size(live, keycodes,
+				    module->input_dev->keycodemax),
+			GFP_KERNEL);
+}
+
+static void qmk_live_free(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct qmk_live_keymap, rcu));
+}
+
+/* frees a table once no scan can be using it any more */
+static void qmk_live_retire(struct qmk_module *module,
+			    struct qmk_live_keymap *live)
+{
+	if (live)
+		call_srcu(&module->keymap_srcu, &live->rcu, qmk_live_free);
+}
+
+/* called with input_dev->event_lock held, returns the table replaced */
+static struct qmk_live_keymap *qmk_live_publish(struct qmk_module *module,
+						struct qmk_live_keymap *live)
+{
+	struct qmk_live_keymap *old = module->live;
+
+	module->live = live;
+	rcu_assign_pointer(module->keyboard->keymap, live->keycodes);
+	module->input_dev->keycode = live->keycodes;
+	/* tells the effective keymap cache to start over */
+	smp_store_release(&module->keymap_gen, module->keymap_gen + 1);
+
+	return old;
+}
+
+static int qmk_reload_commit(struct qmk_module *module,
+			     const struct qmk_keymap_header *header,
+			     size_t size)
+{
+	struct input_dev *input = module->input_dev;
+	const __le16 *keycodes = (const __le16 *)(header + 1);
+	struct qmk_live_keymap *live, *old = NULL;
+	struct qmk_sparse_keymap *sparse, *old_sparse;
+	unsigned int layers = le16_to_cpu(header->layers);
+	unsigned int rows = le16_to_cpu(header->rows);
+	unsigned int cols = le16_to_cpu(header->cols);
+	unsigned int profile = le16_to_cpu(header->profile);
+	unsigned int layer, row, col, i = 0;
+	DECLARE_BITMAP(keybit, KEY_CNT);
+	unsigned short *keymap;
+	unsigned long flags;
+
+	if (qmk_reload_crc(keycodes, size - sizeof(*header)) !=
+	    le32_to_cpu(header->crc)) {
+		dev_err(module->dev, "keymap checksum mismatch\n");
+		return -EBADMSG;
+	}
+
+	qmk_remap_sync(module);
+
+	live = qmk_live_alloc(module);
+	if (!live)
+		return -ENOMEM;
+
+	keymap = live->keycodes;
+	for (layer = 0; layer < layers; layer++)
+		for (row = 0; row < rows; row++)
+			for (col = 0; col < cols; col++)
+				keymap[QMK_MATRIX_SCAN_CODE(layer, row, col,
+							    module->layer_shift,
+							    module->row_shift)] =
+					le16_to_cpu(keycodes[i++]);
+	for (; layer < module->keyboard->layers; layer++)
+		for (row = 0; row < rows; row++)
+			for (col = 0; col < cols; col++)
+				keymap[QMK_MATRIX_SCAN_CODE(layer, row, col,
+							    module->layer_shift,
+							    module->row_shift)] =
+					KC_TRNS;
+
+	sparse = qmk_sparse_build(module, keymap, module->keyboard->layers);
+	if (!sparse) {
+		kvfree(live);
+		return -ENOMEM;
+	}
+
+	/* gathered here, so only the merge runs with interrupts off */
+	bitmap_zero(keybit, KEY_CNT);
+	for (i = 0; i < input->keycodemax; i++)
+		if (keymap[i] && keymap[i] < 0xFF)
+			__set_bit(keycode_to_scancode[keymap[i]], keybit);
+	__clear_bit(KEY_RESERVED, keybit);
+
+	spin_lock_irqsave(&input->event_lock, flags);
+
+	bitmap_or(input->keybit, input->keybit, keybit, KEY_CNT);
+
+	old_sparse = module->profiles[profile];
+	module->profiles[profile] = sparse;
+	module->num_profiles = max(module->num_profiles, profile + 1);
+	if (profile == module->profile) {
+		old = qmk_live_publish(module, live);
+		live = NULL;
+	}
+
+	spin_unlock_irqrestore(&input->event_lock, flags);
+
+	kvfree(live);
+	qmk_live_retire(module, old);
+	qmk_sparse_free(old_sparse);
+
+	dev_info(module->dev,
+		 "loaded %u layer keymap into profile %u, %zu bytes\n",
+		 layers, profile, qmk_sparse_size(sparse));
+
+	return 0;
+}
+
+static void qmk_reload_discard(struct qmk_module *module)
+{
+	kvfree(module->reload_blob);
+	module->reload_blob = NULL;
+	module->reload_size = 0;
+	module->reload_staged = 0;
+}
+
+/*
+ * Writes must follow each other without gaps; one at offset 0 starts a new
+ * keymap and must hold at least the header.
+ */
+ssize_t qmk_reload_write(struct qmk_module *module, const char *buf,
+			 loff_t off, size_t count)
+{
+	const struct qmk_keymap_header *header;
+	ssize_t ret = count;
+	int err;
+
+	mutex_lock(&module->reload_lock);
+
+	if (!off) {
+		qmk_reload_discard(module);
+
+		header = (const struct qmk_keymap_header *)buf;
+		if (count < sizeof(*header)) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		err = qmk_reload_check(module, header);
+		if (err) {
+			ret = err;
+			goto out;
+		}
+
+		module->reload_size = qmk_reload_size(header);
+		module->reload_blob = kvmalloc(module->reload_size,
+					       GFP_KERNEL);
+		if (!module->reload_blob) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	} else if (!module->reload_blob || off != module->reload_staged) {
+		ret = -EINVAL;
+		goto out_discard;
+	}
+
+	if (count > module->reload_size - module->reload_staged) {
+		dev_err(module->dev, "keymap longer than its header says\n");
+		ret = -EFBIG;
+		goto out_discard;
+	}
+
+	memcpy(module->reload_blob + module->reload_staged, buf, count);
+	module->reload_staged += count;
+
+	if (module->reload_staged < module->reload_size)
+		goto out;
+
+	err = qmk_reload_commit(module, module->reload_blob,
+				module->reload_size);
+	if (err)
+		ret = err;
+
+out_discard:
+	qmk_reload_discard(module);
+out:
+	mutex_unlock(&module->reload_lock);
+
+	return ret;
+}
+
+/*
+ * Loads a whole keymap held in memory, used in place: it is checked and
+ * expanded straight into the tables the keyboard runs from. Called with
+ * reload_lock held.
+ */
+static int qmk_reload_load(struct qmk_module *module, const void *data,
+			   size_t size)
+{
+	const struct qmk_keymap_header *header = data;
+	int err;
+
+	if (size < sizeof(*header))
+		return -EINVAL;
+
+	err = qmk_reload_check(module, header);
+	if (err)
+		return err;
+
+	if (size != qmk_reload_size(header))
+		return -EINVAL;
+
+	return qmk_reload_commit(module, header, size);
+}
+
+static void qmk_reload_firmware(const struct firmware *fw, void *context)
+{
+	struct qmk_module *module = context;
+	int err;
+
+	if (!fw) {
+		dev_warn(module->dev, "no keymap %s, keeping the built-in one\n",
+			 module->pdata->keymap_firmware);
+		goto out;
+	}
+
+	mutex_lock(&module->reload_lock);
+	err = qmk_reload_load(module, fw->data, fw->size);
+	mutex_unlock(&module->reload_lock);
+
+	if (err)
+		dev_err(module->dev, "failed to load keymap %s, err=%d\n",
+			module->pdata->keymap_firmware, err);
+
+	release_firmware(fw);
+out:
+	complete_all(&module->keymap_firmware_done);
+}
+
+/*
+ * Called once the input device is registered, so probe does not wait for
+ * the root filesystem or a firmware loader.
+ */
+int qmk_reload_request(struct qmk_module *module)
+{
+	const char *name = module->pdata->keymap_firmware;
+	int err;
+
+	if (!name)
+		return 0;
+
+	reinit_completion(&module->keymap_firmware_done);
+	err = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, name,
+				      module->dev, GFP_KERNEL, module,
+				      qmk_reload_firmware);
+	if (err)
+		complete_all(&module->keymap_firmware_done);
+
+	return err;
+}
+
+/*
+ * Called with keymap_srcu held, the table returned stays valid until it
+ * is dropped
+ */
+const unsigned short *qmk_reload_current(struct qmk_module *module,
+					 unsigned int *profile)
+{
+	struct input_dev *input = module->input_dev;
+	const unsigned short *keymap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&input->event_lock, flags);
+	keymap = module->live->keycodes;
+	*profile = module->profile;
+	spin_unlock_irqrestore(&input->event_lock, flags);
+
+	return keymap;
+}
+
+/*
+ * Writes every layer of @keymap out in the format keymap_bin takes,
+ * @header must be followed by room for the keycodes
+ */
+void qmk_reload_export(struct qmk_module *module, const unsigned short *keymap,
+		       unsigned int profile, struct qmk_keymap_header *header)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	__le16 *keycodes = (__le16 *)(header + 1);
+	unsigned int layer, row, col, i = 0;
+
+	header->magic = cpu_to_le32(QMK_KEYMAP_MAGIC);
+	header->version = cpu_to_le16(QMK_KEYMAP_VERSION);
+	header->layers = cpu_to_le16(keyboard->layers);
+	header->rows = cpu_to_le16(keyboard->rows);
+	header->cols = cpu_to_le16(keyboard->cols);
+	header->profile = cpu_to_le16(profile);
+	header->reserved = 0;
+
+	for (layer = 0; layer < keyboard->layers; layer++)
+		for (row = 0; row < keyboard->rows; row++)
+			for (col = 0; col < keyboard->cols; col++)
+				keycodes[i++] = cpu_to_le16(
+					keymap[QMK_MATRIX_SCAN_CODE(
+						layer, row, col,
+						module->layer_shift,
+						module->row_shift)]);
+
+	header->crc = cpu_to_le32(qmk_reload_crc(keycodes,
+						 i * sizeof(*keycodes)));
+}
+
+/* reads back every layer of the active profile, in the format written */
+ssize_t qmk_reload_read(struct qmk_module *module, char *buf, loff_t off,
+			size_t count)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	const unsigned short *keymap;
+	struct qmk_keymap_header *header;
+	unsigned int profile;
+	size_t size;
+	ssize_t len;
+	int srcu;
+
+	size = QMK_KEYMAP_SIZE(keyboard->layers, keyboard->rows,
+			       keyboard->cols);
+	header = kvmalloc(size, GFP_KERNEL);
+	if (!header)
+		return -ENOMEM;
+
+	srcu = srcu_read_lock(&module->keymap_srcu);
+	keymap = qmk_reload_current(module, &profile);
+	qmk_reload_export(module, keymap, profile, header);
+	srcu_read_unlock(&module->keymap_srcu, srcu);
+
+	len = memory_read_from_buffer(buf, count, &off, header, size);
+	kvfree(header);
+
+	return len;
+}
+
+/*
+ * Called with scan_lock held, from the scan itself for the PROFILE(n)
+ * keycodes. Takes effect for the next key pressed.
+ */
+int qmk_profile_select(struct qmk_module *module, unsigned int profile)
+{
+	struct input_dev *input = module->input_dev;
+	struct qmk_live_keymap *live, *old;
+	unsigned long flags;
+	int err = 0;
+
+	if (profile >= QMK_MAX_PROFILES)
+		return -EINVAL;
+
+	mutex_lock(&module->reload_lock);
+
+	if (!module->profiles[profile]) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	if (profile == module->profile)
+		goto out;
+
+	/* keys remapped in the table about to go are kept in its profile */
+	qmk_remap_sync(module);
+
+	live = qmk_live_alloc(module);
+	if (!live) {
+		err = -ENOMEM;
+		goto out;
+	}
+	qmk_sparse_expand(module, module->profiles[profile], live->keycodes);
+
+	spin_lock_irqsave(&input->event_lock, flags);
+	module->profile = profile;
+	old = qmk_live_publish(module, live);
+	spin_unlock_irqrestore(&input->event_lock, flags);
+
+	qmk_live_retire(module, old);
+
+out:
+	mutex_unlock(&module->reload_lock);
+
+	if (!err)
+		queue_socket_message((uint8_t[]){ ACTIVE_PROFILE, profile }, 2);
+
+	return err;
+}
+
+/*
+ * Profile 0 is the keymap built at probe, further ones are named by
+ * qmk,profile-keymaps. Each is kept sparse, and the one built at probe is
+ * moved into a table of its own so every table in use can be retired the
+ * same way.
+ */
+static int qmk_profile_init(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	struct input_dev *input = module->input_dev;
+	const char *names[QMK_MAX_PROFILES - 1];
+	struct qmk_live_keymap *live;
+	unsigned short *keymap;
+	int i, count;
+
+	live = qmk_live_alloc(module);
+	if (!live)
+		return -ENOMEM;
+
+	keymap = input->keycode;
+	memcpy(live->keycodes, keymap,
+	       input->keycodemax * sizeof(*live->keycodes));
+	qmk_live_publish(module, live);
+	devm_kfree(module->dev, keymap);
+
+	module->profiles[0] = qmk_sparse_build(module, live->keycodes,
+					       keyboard->layers);
+	if (!module->profiles[0])
+		return -ENOMEM;
+	module->num_profiles = 1;
+
+	count = device_property_read_string_array(module->dev,
+						  "qmk,profile-keymaps", names,
+						  ARRAY_SIZE(names));
+	if (count <= 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		keymap = qmk_build_profile(names[i], keyboard->layers,
+					   keyboard->rows, keyboard->cols,
+					   input);
+		if (IS_ERR(keymap)) {
+			dev_err(module->dev, "failed to build profile %d\n",
+				i + 1);
+			return PTR_ERR(keymap);
+		}
+
+		module->profiles[i + 1] = qmk_sparse_build(module, keymap,
+							   keyboard->layers);
+		devm_kfree(module->dev, keymap);
+		if (!module->profiles[i + 1])
+			return -ENOMEM;
+		module->num_profiles++;
+	}
+
+	return 0;
+}
+
+int qmk_reload_init(struct qmk_module *module)
+{
+	int err;
+
+	mutex_init(&module->reload_lock);
+	qmk_remap_init(module);
+	init_completion(&module->keymap_firmware_done);
+	complete_all(&module->keymap_firmware_done);
+
+	err = init_srcu_struct(&module->keymap_srcu);
+	if (err)
+		return err;
+
+	err = qmk_profile_init(module);
+	if (err)
+		goto err_exit;
+
+	if (module->pdata->keymap_bin) {
+		mutex_lock(&module->reload_lock);
+		err = qmk_reload_load(module, module->pdata->keymap_bin,
+				      module->pdata->keymap_bin_size);
+		mutex_unlock(&module->reload_lock);
+		if (err) {
+			dev_err(module->dev, "invalid keymap, err=%d\n", err);
+			goto err_exit;
+		}
+	}
+
+	return 0;
+
+err_exit:
+	qmk_reload_exit(module);
+	return err;
+}
+
+void qmk_reload_exit(struct qmk_module *module)
+{
+	int i;
+
+	wait_for_completion(&module->keymap_firmware_done);
+	qmk_remap_exit(module);
+	qmk_reload_discard(module);
+
+	srcu_barrier(&module->keymap_srcu);
+	cleanup_srcu_struct(&module->keymap_srcu);
+
+	for (i = 0; i < QMK_MAX_PROFILES; i++) {
+		qmk_sparse_free(module->profiles[i]);
+		module->profiles[i] = NULL;
+	}
+	kvfree(module->live);
+	module->live = NULL;
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,208 @@
+/*
+ * Single key remapping through EVIOCSKEYCODE
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitops.h>
+#include <linux/input.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include <qmk/keycodes/basic.h>
+#include "qmk_scancodes.h"
+
+/*
+ * Userspace addresses a key as QMK_SCANCODE(layer, row, col), which is
+ * also what MSC_SCAN reports for layer 0, or by index in layer, row and
+ * column order without the padding of the table. Only basic keycodes have
+ * a Linux keycode: the others read back as KEY_RESERVED, and writing
+ * KEY_RESERVED clears the key, to KC_NO on layer 0 and to KC_TRNS above
+ * it so the layers below show through.
+ *
+ * The input core calls in with event_lock held, so the key is changed in
+ * place in the table in use, and the effective keymap cache drops that key
+ * only. The active profile's sparse copy is rebuilt later from a work item,
+ * or right away when the profile is about to be replaced.
+ */
+
+/* the remap has to be folded into the active profile */
+#define QMK_REMAP_PENDING 0
+
+static int qmk_remap_key(struct qmk_module *module,
+			 const struct input_keymap_entry *ke,
+			 unsigned int *layer, unsigned int *row,
+			 unsigned int *col, unsigned int *scancode)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int index;
+	int err;
+
+	if (ke->flags & INPUT_KEYMAP_BY_INDEX) {
+		index = ke->index;
+		*col = index % keyboard->cols;
+		index /= keyboard->cols;
+		*row = index % keyboard->rows;
+		*layer = index / keyboard->rows;
+	} else {
+		err = input_scancode_to_scalar(ke, scancode);
+		if (err)
+			return err;
+		if (*scancode >> 24)
+			return -EINVAL;
+		*layer = (*scancode >> 16) & 0xff;
+		*row = (*scancode >> 8) & 0xff;
+		*col = *scancode & 0xff;
+	}
+
+	if (*layer >= keyboard->layers || *row >= keyboard->rows ||
+	    *col >= keyboard->cols)
+		return -EINVAL;
+
+	*scancode = QMK_SCANCODE(*layer, *row, *col);
+
+	return 0;
+}
+
+static unsigned int qmk_remap_to_linux(unsigned short code)
+{
+	return code < ARRAY_SIZE(keycode_to_scancode) ?
+		       keycode_to_scancode[code] :
+		       KEY_RESERVED;
+}
+
+static int qmk_remap_from_linux(unsigned int keycode, unsigned int layer)
+{
+	int code;
+
+	if (keycode == KEY_RESERVED)
+		return layer ? KC_TRNS : KC_NO;
+
+	for (code = KC_A; code < ARRAY_SIZE(keycode_to_scancode); code++)
+		if (keycode_to_scancode[code] == keycode)
+			return code;
+
+	return -EINVAL;
+}
+
+static int qmk_getkeycode(struct input_dev *input,
+			  struct input_keymap_entry *ke)
+{
+	struct qmk_module *module = input_get_drvdata(input);
+	const unsigned short *keymap = input->keycode;
+	unsigned int layer, row, col, scancode;
+	int err;
+
+	err = qmk_remap_key(module, ke, &layer, &row, &col, &scancode);
+	if (err)
+		return err;
+
+	ke->keycode = qmk_remap_to_linux(keymap[QMK_MATRIX_SCAN_CODE(
+		layer, row, col, module->layer_shift, module->row_shift)]);
+	ke->index = (layer * module->keyboard->rows + row) *
+			    module->keyboard->cols +
+		    col;
+	ke->len = sizeof(scancode);
+	memcpy(ke->scancode, &scancode, sizeof(scancode));
+
+	return 0;
+}
+
+/*
+ * Key bits are only ever set here, never cleared: other profiles and the
+ * encoders may still send the old keycode.
+ */
+static int qmk_setkeycode(struct input_dev *input,
+			  const struct input_keymap_entry *ke,
+			  unsigned int *old_keycode)
+{
+	struct qmk_module *module = input_get_drvdata(input);
+	unsigned short *keymap = input->keycode;
+	unsigned int layer, row, col, scancode, index;
+	int code, err;
+
+	err = qmk_remap_key(module, ke, &layer, &row, &col, &scancode);
+	if (err)
+		return err;
+
+	code = qmk_remap_from_linux(ke->keycode, layer);
+	if (code < 0)
+		return code;
+
+	index = QMK_MATRIX_SCAN_CODE(layer, row, col, module->layer_shift,
+				     module->row_shift);
+	*old_keycode = qmk_remap_to_linux(keymap[index]);
+	WRITE_ONCE(keymap[index], code);
+	if (ke->keycode != KEY_RESERVED)
+		__set_bit(ke->keycode, input->keybit);
+
+	qmk_effective_invalidate(module, row * module->keyboard->cols + col);
+
+	set_bit(QMK_REMAP_PENDING, &module->remap_flags);
+	schedule_work(&module->remap_work);
+
+	return 0;
+}
+
+/*
+ * Called with reload_lock held, before the table in use is replaced and
+ * from the work item. The table only changes under reload_lock, so it can
+ * be read here without event_lock; a remap landing meanwhile sets the flag
+ * again.
+ */
+void qmk_remap_sync(struct qmk_module *module)
+{
+	struct qmk_sparse_keymap *sparse;
+
+	if (!test_and_clear_bit(QMK_REMAP_PENDING, &module->remap_flags))
+		return;
+
+	sparse = qmk_sparse_build(module, module->input_dev->keycode,
+				  module->keyboard->layers);
+	if (!sparse) {
+		dev_err(module->dev, "no memory to keep remapped keys\n");
+		return;
+	}
+
+	qmk_sparse_free(module->profiles[module->profile]);
+	module->profiles[module->profile] = sparse;
+}
+
+static void qmk_remap_work(struct work_struct *work)
+{
+	struct qmk_module *module =
+		container_of(work, struct qmk_module, remap_work);
+
+	mutex_lock(&module->reload_lock);
+	qmk_remap_sync(module);
+	mutex_unlock(&module->reload_lock);
+}
+
+/* called before the input device is registered */
+void qmk_remap_init(struct qmk_module *module)
+{
+	struct input_dev *input = module->input_dev;
+
+	INIT_WORK(&module->remap_work, qmk_remap_work);
+	module->event_scancode = QMK_SCANCODE_NONE;
+
+	input->getkeycode = qmk_getkeycode;
+	input->setkeycode = qmk_setkeycode;
+}
+
+void qmk_remap_exit(struct qmk_module *module)
+{
+	cancel_work_sync(&module->remap_work);
+}
+
+MODULE_LICENSE("GPL");
@@ -1,71 +1,330 @@
 #include "qmk.h"
 #include <linux/delay.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/input-polldev.h>
 #include <linux/input.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
 #include <linux/pinctrl/consumer.h>
+#include <linux/pm_wakeup.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
 #include <qmk/keycodes/process.h>
 #include <qmk/protocol.h>
 #include <qmk/types.h>
 #include "qmk_socket.h"
 
-int qmk_init_gpio(struct platform_device *pdev, struct qmk_module *module)
+/*
+ * Matrix state is kept as one bitmap per scan, where each column owns a
+ * power-of-two number of whole words holding its rows. Boards with up to
+ * BITS_PER_LONG rows therefore use a single word per column.
+ */
+int qmk_alloc_matrix(struct qmk_module *module)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	size_t words;
+
+	module->col_shift =
+		get_count_order(BITS_TO_LONGS(keyboard->rows) * BITS_PER_LONG);
+	module->matrix_bits = keyboard->cols << module->col_shift;
+	words = BITS_TO_LONGS(module->matrix_bits);
+
+	module->last_key_state = devm_kcalloc(module->dev, words,
+					      sizeof(unsigned long), GFP_KERNEL);
+	module->current_key_state = devm_kcalloc(
+		module->dev, words, sizeof(unsigned long), GFP_KERNEL);
+	module->changed_key_state = devm_kcalloc(
+		module->dev, words, sizeof(unsigned long), GFP_KERNEL);
+	module->ghost_mask = devm_kcalloc(module->dev, words,
+					  sizeof(unsigned long), GFP_KERNEL);
+
+	if (!module->last_key_state || !module->current_key_state ||
+	    !module->changed_key_state || !module->ghost_mask)
+		return -ENOMEM;
+
+	return 0;
+}
+QMK_EXPORT_IF_KUNIT(qmk_alloc_matrix);
+
+/*
+ * Either side of the matrix can be strobed. Strobing the rows instead of
+ * the columns inverts the drive polarity and the pulls on the sensed lines,
+ * so current still flows through the diodes in the direction they allow.
+ * The scan result is transposed back, the keymap layout never changes.
+ */
+void qmk_setup_strobe(struct qmk_module *module)
 {
 	const struct qmk_platform_data *pdata = module->pdata;
 	struct qmk_keyboard *keyboard = module->keyboard;
+
+	if (pdata->direct_pins) {
+		module->transposed = false;
+		module->strobe_gpios = NULL;
+		module->num_strobe = 0;
+		module->sense_gpios = pdata->col_gpios;
+		module->num_sense = keyboard->cols;
+		module->strobe_active_low = pdata->active_low;
+		return;
+	}
+
+	/* analog rows are ADC channels, only the columns are gpios */
+	if (pdata->analog) {
+		module->transposed = false;
+		module->strobe_gpios = pdata->col_gpios;
+		module->num_strobe = keyboard->cols;
+		module->sense_gpios = NULL;
+		module->num_sense = 0;
+		module->strobe_active_low = pdata->active_low;
+		return;
+	}
+
+	switch (pdata->strobe) {
+	case QMK_STROBE_ROWS:
+		module->transposed = true;
+		break;
+	case QMK_STROBE_AUTO:
+		module->transposed = keyboard->rows < keyboard->cols;
+		break;
+	default:
+		module->transposed = false;
+		break;
+	}
+
+	if (module->transposed) {
+		module->strobe_gpios = pdata->row_gpios;
+		module->num_strobe = keyboard->rows;
+		module->sense_gpios = pdata->col_gpios;
+		module->num_sense = keyboard->cols;
+	} else {
+		module->strobe_gpios = pdata->col_gpios;
+		module->num_strobe = keyboard->cols;
+		module->sense_gpios = pdata->row_gpios;
+		module->num_sense = keyboard->rows;
+	}
+
+	module->strobe_active_low = pdata->active_low ^ module->transposed;
+}
+
+/*
+ * Sense lines behind an I2C/SPI expander cost a bus transaction per
+ * gpio_get_value(). Reading them as one array lets gpiolib fetch a whole
+ * port of the expander in a single transfer per strobe.
+ */
+static bool qmk_sense_cansleep(struct qmk_module *module)
+{
+	int i;
+
+	/* gpio_get_value() is not allowed on any line that sleeps */
+	for (i = 0; i < module->num_sense; i++)
+		if (gpio_cansleep(module->sense_gpios[i]))
+			return true;
+
+	return false;
+}
+
+static int qmk_setup_batch(struct qmk_module *module)
+{
+	int i;
+
+	module->sense_descs = devm_kcalloc(module->dev, module->num_sense,
+					   sizeof(*module->sense_descs),
+					   GFP_KERNEL);
+	module->sense_values = devm_kcalloc(module->dev,
+					    BITS_TO_LONGS(module->num_sense),
+					    sizeof(unsigned long), GFP_KERNEL);
+	if (!module->sense_descs || !module->sense_values)
+		return -ENOMEM;
+
+	for (i = 0; i < module->num_sense; i++)
+		module->sense_descs[i] = gpio_to_desc(module->sense_gpios[i]);
+
+	return 0;
+}
+
+int qmk_init_gpio(struct platform_device *pdev, struct qmk_module *module)
+{
 	int i, err;
 
+	if (module->pdata->direct_pins)
+		return qmk_direct_init(pdev, module);
+
 	/* initialized strobe lines as outputs, activated */
-	for (i = 0; i < keyboard->cols; i++) {
-		err = gpio_request(pdata->col_gpios[i], "matrix_kbd_col");
+	for (i = 0; i < module->num_strobe; i++) {
+		err = gpio_request(module->strobe_gpios[i],
+				   "matrix_kbd_strobe");
 		if (err) {
 			dev_err(&pdev->dev,
-				"failed to request GPIO%d for COL%d\n",
-				pdata->col_gpios[i], i);
-			goto err_free_cols;
+				"failed to request GPIO%d for strobe %d\n",
+				module->strobe_gpios[i], i);
+			goto err_free_strobe;
 		}
 
-		gpio_direction_output(pdata->col_gpios[i], !pdata->active_low);
+		gpio_direction_output(module->strobe_gpios[i],
+				      !module->strobe_active_low);
 	}
 
-	for (i = 0; i < keyboard->rows; i++) {
-		err = pinctrl_gpio_request(pdata->row_gpios[i]);
+	for (i = 0; i < module->num_sense; i++) {
+		err = pinctrl_gpio_request(module->sense_gpios[i]);
 		if (err) {
 			dev_err(&pdev->dev,
-				"failed to request pinctrl for GPIO%d on ROW%d\n",
-				pdata->row_gpios[i], i);
-			goto err_free_rows;
+				"failed to request pinctrl for GPIO%d on sense %d\n",
+				module->sense_gpios[i], i);
+			goto err_free_sense;
 		}
 
-		pinctrl_gpio_set_config(pdata->row_gpios[i],
-					PIN_CONFIG_BIAS_PULL_DOWN);
-		pinctrl_gpio_direction_input(pdata->row_gpios[i]);
+		pinctrl_gpio_set_config(module->sense_gpios[i],
+					module->strobe_active_low ?
+						PIN_CONFIG_BIAS_PULL_UP :
+						PIN_CONFIG_BIAS_PULL_DOWN);
+		pinctrl_gpio_direction_input(module->sense_gpios[i]);
+	}
+
+	if (qmk_sense_cansleep(module)) {
+		err = qmk_setup_batch(module);
+		if (err) {
+			dev_err(&pdev->dev, "no memory for sense batch\n");
+			goto err_free_sense;
+		}
 	}
 
 	return 0;
 
-err_free_rows:
+err_free_sense:
 	while (--i >= 0)
-		pinctrl_gpio_free(pdata->row_gpios[i]);
-	i = keyboard->cols;
-err_free_cols:
+		pinctrl_gpio_free(module->sense_gpios[i]);
+	i = module->num_strobe;
+err_free_strobe:
 	while (--i >= 0)
-		gpio_free(pdata->col_gpios[i]);
+		gpio_free(module->strobe_gpios[i]);
 
 	return err;
 }
 
 void qmk_free_gpio(struct qmk_module *module)
 {
-	const struct qmk_platform_data *pdata = module->pdata;
-	struct qmk_keyboard *keyboard = module->keyboard;
 	int i;
 
-	for (i = 0; i < keyboard->rows; i++)
-		pinctrl_gpio_free(pdata->row_gpios[i]);
+	if (module->pdata->direct_pins) {
+		qmk_direct_free(module);
+		return;
+	}
+
+	if (module->wakeup_irqs) {
+		for (i = 0; i < module->num_sense; i++)
+			free_irq(gpio_to_irq(module->sense_gpios[i]), module);
+		module->wakeup_irqs = false;
+	}
+
+	for (i = 0; i < module->num_sense; i++)
+		pinctrl_gpio_free(module->sense_gpios[i]);
+
+	for (i = 0; i < module->num_strobe; i++)
+		gpio_free(module->strobe_gpios[i]);
+}
+
+static irqreturn_t qmk_wakeup_irq(int irq, void *id)
+{
+	struct qmk_module *module = id;
+
+	pm_wakeup_event(module->dev, 0);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Sense line interrupts are only used to wake the system up; they stay
+ * disabled unless the system is suspended. Direct pins wake the system
+ * through the interrupts they are scanned with.
+ */
+int qmk_init_wakeup(struct qmk_module *module)
+{
+	unsigned long flags = module->strobe_active_low ?
+				      IRQF_TRIGGER_FALLING :
+				      IRQF_TRIGGER_RISING;
+	int i, irq, err;
+
+	if (module->pdata->direct_pins)
+		return 0;
+
+	for (i = 0; i < module->num_sense; i++) {
+		irq = gpio_to_irq(module->sense_gpios[i]);
+		if (irq < 0) {
+			err = irq;
+			goto err_free_irqs;
+		}
+
+		irq_set_status_flags(irq, IRQ_NOAUTOEN);
+		err = request_any_context_irq(irq, qmk_wakeup_irq, flags,
+					      "qmk-wakeup", module);
+		if (err < 0)
+			goto err_free_irqs;
+	}
+
+	module->wakeup_irqs = true;
+
+	return 0;
+
+err_free_irqs:
+	while (--i >= 0)
+		free_irq(gpio_to_irq(module->sense_gpios[i]), module);
+
+	return err;
+}
+
+/* releases the strobe lines while nobody is scanning */
+void qmk_idle_gpio(struct qmk_module *module)
+{
+	int i;
+
+	for (i = 0; i < module->num_strobe; i++) {
+		if (module->scan_params.drive_inactive_cols)
+			gpio_direction_output(module->strobe_gpios[i],
+					      module->strobe_active_low);
+		else
+			gpio_direction_input(module->strobe_gpios[i]);
+	}
+}
+
+/*
+ * Called with scan_lock held when gpio-activelow is changed at runtime.
+ * The sense pulls, the idle level of the strobe lines and the wakeup edge
+ * all follow the new polarity.
+ */
+void qmk_set_polarity(struct qmk_module *module, bool active_low)
+{
+	unsigned int type;
+	int i;
+
+	module->strobe_active_low = active_low ^ module->transposed;
+	type = module->strobe_active_low ? IRQ_TYPE_EDGE_FALLING :
+					   IRQ_TYPE_EDGE_RISING;
 
-	for (i = 0; i < keyboard->cols; i++)
-		gpio_free(pdata->col_gpios[i]);
+	for (i = 0; i < module->num_sense; i++) {
+		pinctrl_gpio_set_config(module->sense_gpios[i],
+					module->strobe_active_low ?
+						PIN_CONFIG_BIAS_PULL_UP :
+						PIN_CONFIG_BIAS_PULL_DOWN);
+		if (module->wakeup_irqs)
+			irq_set_irq_type(gpio_to_irq(module->sense_gpios[i]),
+					 type);
+	}
+
+	for (i = 0; i < module->num_strobe; i++)
+		gpio_set_value_cansleep(module->strobe_gpios[i],
+					module->strobe_active_low);
+}
+
+/* drives every strobe line so that any key press asserts its sense line */
+void qmk_arm_gpio(struct qmk_module *module)
+{
+	int i;
+
+	for (i = 0; i < module->num_strobe; i++)
+		gpio_direction_output(module->strobe_gpios[i],
+				      !module->strobe_active_low);
 }
 
 /*
@@ -74,112 +333,332 @@ void qmk_free_gpio(struct qmk_module *module)
  * columns. In that case it is configured here to be input, otherwise it is
  * driven with the inactive value.
  */
-static void activate_col(const struct qmk_platform_data *pdata, int col,
-			 bool on)
+static void activate_strobe(struct qmk_module *module, int strobe, bool on)
 {
-	bool level_on = !pdata->active_low;
+	bool level_on = !module->strobe_active_low;
 
 	if (on) {
-		gpio_direction_output(pdata->col_gpios[col], level_on);
-		if (pdata->col_scan_delay_us)
-			udelay(pdata->col_scan_delay_us);
+		gpio_direction_output(module->strobe_gpios[strobe], level_on);
 	} else {
-		// gpio_direction_output(pdata->col_gpios[col], !level_on);
-		gpio_set_value_cansleep(pdata->col_gpios[col], !level_on);
+		// gpio_direction_output(module->strobe_gpios[strobe], !level_on);
+		gpio_set_value_cansleep(module->strobe_gpios[strobe],
+					!level_on);
+	}
+}
+
+static bool sense_asserted(struct qmk_module *module, int sense)
+{
+	return gpio_get_value(module->sense_gpios[sense]) ?
+		       !module->strobe_active_low :
+		       module->strobe_active_low;
+}
+
+/* reads all sense lines in one go, see qmk_setup_batch() */
+static void qmk_read_sense_batch(struct qmk_module *module, unsigned int bit,
+				 unsigned int step)
+{
+	unsigned long *values = module->sense_values;
+	unsigned int sense;
+
+	if (gpiod_get_raw_array_value_cansleep(module->num_sense,
+					       module->sense_descs, NULL,
+					       values))
+		return;
+
+	if (module->strobe_active_low)
+		bitmap_complement(values, values, module->num_sense);
+
+	for_each_set_bit(sense, values, module->num_sense)
+		__set_bit(bit + sense * step, module->current_key_state);
+}
+
+/*
+ * Asserts each strobe line and reads the sense lines out, stepping along a
+ * column or across columns when the matrix is transposed. Only the GPIO
+ * and ADC accesses count towards bus_ns, not the settle delay.
+ */
+static void qmk_read_matrix(struct qmk_module *module)
+{
+	unsigned long *state = module->current_key_state;
+	unsigned int bit, step;
+	int strobe, sense;
+	u64 bus_start;
+
+	step = module->transposed ? 1 << module->col_shift : 1;
+	for (strobe = 0; strobe < module->num_strobe; strobe++) {
+		bit = module->transposed ? strobe : strobe << module->col_shift;
+
+		bus_start = ktime_get_ns();
+		activate_strobe(module, strobe, true);
+		module->bus_ns += ktime_get_ns() - bus_start;
+
+		if (module->settle_us)
+			udelay(module->settle_us);
+
+		bus_start = ktime_get_ns();
+
+		if (module->analog) {
+			qmk_analog_read(module, strobe);
+		} else if (module->sense_descs) {
+			qmk_read_sense_batch(module, bit, step);
+		} else {
+			for (sense = 0; sense < module->num_sense; sense++) {
+				if (sense_asserted(module, sense))
+					__set_bit(bit, state);
+				bit += step;
+			}
+		}
+
+		activate_strobe(module, strobe, false);
+		module->bus_ns += ktime_get_ns() - bus_start;
 	}
 }
 
-static bool row_asserted(const struct qmk_platform_data *pdata, int row)
+/*
+ * Called with scan_lock held after a scan that took longer than its
+ * interval QMK_OVERRUN_STREAK times in a row. Userspace hears about it
+ * through a uevent and the netlink socket; with overrun_degrade the settle
+ * delay is halved as well, down to a microsecond.
+ */
+static void qmk_scan_overrun(struct qmk_module *module)
 {
-	return gpio_get_value(pdata->row_gpios[row]) ? !pdata->active_low :
-						       pdata->active_low;
+	char settle[32];
+	char *envp[] = { "QMK_SCAN=OVERRUN", settle, NULL };
+
+	if (module->pdata->overrun_degrade && module->settle_us > 1)
+		module->settle_us /= 2;
+
+	dev_warn_ratelimited(module->dev,
+			     "scan overruns its %u ms interval, settle %u us\n",
+			     module->governor.interval, module->settle_us);
+
+	snprintf(settle, sizeof(settle), "QMK_SETTLE_US=%u", module->settle_us);
+	kobject_uevent_env(&module->dev->kobj, KOBJ_CHANGE, envp);
+
+	queue_socket_message((uint8_t[]){ SCAN_OVERRUN,
+					  min(module->settle_us, 255U) }, 2);
+	send_socket_message();
 }
 
-void qmk_analyze_state(struct qmk_module *module);
+/*
+ * The scan thread runs each scan one interval after the previous one
+ * started, while input-polldev queues the next poll one interval after the
+ * previous one returned, so that is when it is due. Lateness is how far
+ * past that a scan starts, an overrun is a scan that takes longer than the
+ * interval itself. Direct pins are scanned on demand and have no deadline.
+ */
+static void qmk_scan_deadline(struct qmk_module *module, u64 start, u64 end)
+{
+	u64 interval = (u64)module->governor.interval * NSEC_PER_MSEC;
+	u64 duration = end - start;
+
+	if (module->pdata->direct_pins)
+		return;
+
+	if (module->scan_due_ns && start > module->scan_due_ns) {
+		module->late_ns += start - module->scan_due_ns;
+		module->late_max_ns =
+			max(module->late_max_ns, start - module->scan_due_ns);
+	}
+	module->scan_due_ns = (module->scan_task ? start : end) + interval;
+	module->scan_max_ns = max(module->scan_max_ns, duration);
+
+	if (duration <= interval) {
+		module->overrun_streak = 0;
+		return;
+	}
+
+	module->overrun_count++;
+	if (++module->overrun_streak == QMK_OVERRUN_STREAK) {
+		module->overrun_streak = 0;
+		qmk_scan_overrun(module);
+	}
+}
 
 /*
  * This gets the keys from keyboard and reports it to input subsystem
  */
+void qmk_scan_matrix(struct qmk_module *module)
+{
+	unsigned long *state = module->current_key_state;
+	bool changed;
+	u64 start = ktime_get_ns();
+	u64 bus_start, end;
+
+	mutex_lock(&module->scan_lock);
+	if (module->replaying) {
+		mutex_unlock(&module->scan_lock);
+		return;
+	}
+
+	qmk_params_apply(module);
+	bitmap_zero(state, module->matrix_bits);
+
+	if (module->pdata->direct_pins) {
+		bus_start = ktime_get_ns();
+		qmk_direct_read(module);
+		module->bus_ns += ktime_get_ns() - bus_start;
+	} else {
+		qmk_read_matrix(module);
+	}
+
+	qmk_capture_scan(module);
+	changed = qmk_analyze_state(module, start);
+	qmk_governor_update(module,
+			    changed || !bitmap_empty(state, module->matrix_bits));
+	if (!changed)
+		qmk_health_scan(module, start);
+
+	end = ktime_get_ns();
+	qmk_scan_deadline(module, start, end);
+	module->scan_ns += end - start;
+	module->scan_count++;
+	mutex_unlock(&module->scan_lock);
+}
+
 void qmk_scan(struct input_polled_dev *polled_dev)
 {
 	struct qmk_module *module = polled_dev->private;
-	struct qmk_keyboard *keyboard = module->keyboard;
-	const struct qmk_platform_data *pdata = module->pdata;
-	int row, col;
 
-	memset(module->current_key_state, 0, sizeof(module->current_key_state));
+	qmk_scan_matrix(module);
 
-	/* assert each column and read the row status out */
-	for (col = 0; col < keyboard->cols; col++) {
-		activate_col(pdata, col, true);
+	/* input-polldev reads this when queueing the next scan */
+	polled_dev->poll_interval = READ_ONCE(module->governor.interval);
+}
 
-		for (row = 0; row < keyboard->rows; row++) {
-			module->current_key_state[col] |=
-				row_asserted(pdata, row) ? (1 << row) : 0;
-		}
+/*
+ * Without diodes, three held corners of a rectangle make the fourth read as
+ * held too, and the two columns then share at least two rows. Any pair of
+ * columns sharing two or more rows is ambiguous: those keys keep their last
+ * reported state until the overlap goes away. Each column is a whole number
+ * of words, so a pair costs one AND and popcount per word; 32x32 is 496
+ * pairs.
+ */
+static void qmk_suppress_ghosts(struct qmk_module *module)
+{
+	unsigned long *state = module->current_key_state;
+	unsigned long *mask = module->ghost_mask;
+	unsigned int words = BIT_WORD(1 << module->col_shift);
+	unsigned int cols = module->keyboard->cols;
+	unsigned int a, b, w, shared;
+	unsigned long *col_a, *col_b;
+	bool ghosted = false;
+
+	bitmap_zero(mask, module->matrix_bits);
+
+	for (a = 0; a < cols; a++) {
+		col_a = state + a * words;
+		for (b = a + 1; b < cols; b++) {
+			col_b = state + b * words;
+
+			shared = 0;
+			for (w = 0; w < words; w++)
+				shared += hweight_long(col_a[w] & col_b[w]);
+			if (shared < 2)
+				continue;
 
-		activate_col(pdata, col, false);
+			for (w = 0; w < words; w++) {
+				mask[a * words + w] |= col_a[w] & col_b[w];
+				mask[b * words + w] |= col_a[w] & col_b[w];
+			}
+			ghosted = true;
+		}
 	}
 
-	qmk_analyze_state(module);
+	if (!ghosted)
+		return;
+
+	/* hold the ambiguous keys at their last state */
+	bitmap_xor(module->changed_key_state, state, module->last_key_state,
+		   module->matrix_bits);
+	if (bitmap_intersects(module->changed_key_state, mask,
+			      module->matrix_bits))
+		module->ghost_count++;
+
+	bitmap_andnot(state, state, mask, module->matrix_bits);
+	bitmap_and(mask, module->last_key_state, mask, module->matrix_bits);
+	bitmap_or(state, state, mask, module->matrix_bits);
 }
 
-void qmk_analyze_state(struct qmk_module *module)
+/*
+ * Reports every key that changed since the last call, returns whether
+ * there were any. @now is when the matrix was read, on the replay's clock
+ * for replays.
+ */
+bool qmk_analyze_state(struct qmk_module *module, u64 now)
 {
 	struct input_dev *input = module->input_dev;
 	struct qmk_keyboard *keyboard = module->keyboard;
-	int row, col;
-	struct qmk_matrix_event *event;
-	qmk_keycode_t keycode = 0;
-	bool pressed, handled;
+	unsigned long *changed = module->changed_key_state;
+	unsigned int bits = module->matrix_bits;
+	unsigned int bit, row, col;
+	struct qmk_matrix_event event = { 0 };
+	qmk_keycode_t keycode = 0, pressed_as;
+	bool pressed, handled, replaced;
+	int srcu;
 
 	uint8_t starting_layer = keyboard->active_layer;
-	uint8_t starting_state = keyboard->layer_state;
-
-	event = devm_kzalloc(&input->dev, sizeof(*event), GFP_KERNEL);
-
-	for (col = 0; col < keyboard->cols; col++) {
-		uint32_t bits_changed;
-
-		bits_changed = module->last_key_state[col] ^
-			       module->current_key_state[col];
-		if (bits_changed != 0) {
-			for (row = 0; row < keyboard->rows; row++) {
-				if ((bits_changed & (1 << row))) {
-					pressed =
-						module->current_key_state[col] &
-						(1 << row);
-					event->row = row;
-					event->col = col;
-					event->pressed = pressed;
-					queue_socket_message((uint8_t[]){ MATRIX_EVENT, row, col, pressed }, 4);
-					handled =
-						process_keycode(keyboard, event,
-								&keycode) ||
-						process_qkm(keyboard, &keycode,
-							    pressed);
-
-					if (!handled) {
-						dev_warn(
-							&input->dev,
-							"unhandled keycode: 0x%x",
-							keycode);
-					}
-				}
-			}
+	uint32_t starting_state = keyboard->layer_state;
+
+	qmk_debounce(module,
+		     module->replaying ? module->replay_debounce :
+					 module->debounce,
+		     now);
+	if (module->anti_ghost)
+		qmk_suppress_ghosts(module);
+
+	if (bitmap_equal(module->last_key_state, module->current_key_state,
+			 bits))
+		return false;
+
+	bitmap_xor(changed, module->last_key_state, module->current_key_state,
+		   bits);
+
+	/* keeps a reloaded keymap from freeing the table used below */
+	srcu = srcu_read_lock(&module->keymap_srcu);
+	for_each_set_bit(bit, changed, bits) {
+		u64 event_start = ktime_get_ns();
+
+		col = bit >> module->col_shift;
+		row = bit & ((1 << module->col_shift) - 1);
+		pressed = test_bit(bit, module->current_key_state);
+
+		qmk_health_event(module, row, col, pressed, event_start);
+
+		event.row = row;
+		event.col = col;
+		event.pressed = pressed;
+		module->event_scancode = QMK_SCANCODE(0, row, col);
+		queue_socket_message((uint8_t[]){ MATRIX_EVENT, row, col, pressed }, 4);
+		replaced = qmk_effective_lookup(module, &event, &keycode);
+		pressed_as = keycode;
+		handled = process_keycode(keyboard, &event, &keycode) ||
+			  process_qkm(keyboard, &keycode, pressed);
+		if (replaced)
+			qmk_effective_release(module, pressed_as);
+
+		if (!handled) {
+			module->unhandled_count++;
+			dev_dbg_ratelimited(&input->dev,
+					    "unhandled keycode: 0x%x\n", keycode);
 		}
+
+		module->event_ns += ktime_get_ns() - event_start;
+		module->event_count++;
 	}
+	module->event_scancode = QMK_SCANCODE_NONE;
+	srcu_read_unlock(&module->keymap_srcu, srcu);
 	input_sync(input);
 
 	if (starting_layer != keyboard->active_layer)
 		queue_socket_message((uint8_t[]){ ACTIVE_LAYER, keyboard->active_layer }, 2);
 	if (starting_state != keyboard->layer_state)
-		queue_socket_message((uint8_t[]){ LAYER_STATE, ((keyboard->layer_state >> 8) & 0xFF), (keyboard->layer_state & 0xFF) }, 3);
+		queue_socket_message((uint8_t[]){ LAYER_STATE, ((keyboard->layer_state >> 24) & 0xFF), ((keyboard->layer_state >> 16) & 0xFF), ((keyboard->layer_state >> 8) & 0xFF), (keyboard->layer_state & 0xFF) }, 5);
 
 	send_socket_message();
 
-	memcpy(module->last_key_state, module->current_key_state,
-	       sizeof(module->current_key_state));
+	bitmap_copy(module->last_key_state, module->current_key_state, bits);
 
-	devm_kfree(&input->dev, event);
+	return true;
 }
+QMK_EXPORT_IF_KUNIT(qmk_analyze_state);
@@ -1,8 +1,10 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/capability.h>
 #include <linux/netlink.h>
 #include <net/netlink.h>
 #include <net/net_namespace.h>
+#include "qmk.h"
 #include "qmk_socket.h"
 
 static struct sock *nl_sk = NULL;
@@ -21,6 +23,19 @@ void nl_input(struct sk_buff *skb)
     nlh = (struct nlmsghdr *) skb->data;
     pid = nlh->nlmsg_pid; // pid of the sending process
 
+    /* anyone may read the keymap, keymap_state is world readable too */
+    if (nlmsg_len(nlh) >= 1 && *(uint8_t *)nlmsg_data(nlh) == KEYMAP_DUMP) {
+        qmk_dump_request(pid);
+        return;
+    }
+
+    /* switches every keyboard, so as privileged as the profile file */
+    if (nlmsg_len(nlh) >= 2 && *(uint8_t *)nlmsg_data(nlh) == ACTIVE_PROFILE) {
+        if (netlink_capable(skb, CAP_SYS_ADMIN))
+            qmk_profile_request(((uint8_t *)nlmsg_data(nlh))[1]);
+        return;
+    }
+
     struct sk_buff *skb_out = nlmsg_new(message_size, GFP_KERNEL);
     if (!skb_out) {
         printk(KERN_ERR "Failed to allocate a new skb\n");
@@ -67,6 +82,27 @@ void send_socket_message(void)
 
 }
 
+/* sends @data to one socket only, for replies too long to be queued */
+int unicast_socket_message(u32 portid, const void *data, size_t size)
+{
+    struct sk_buff *skb;
+    struct nlmsghdr *nlh;
+
+    skb = nlmsg_new(size, GFP_KERNEL);
+    if (!skb)
+        return -ENOMEM;
+
+    nlh = nlmsg_put(skb, 0, 0, NLMSG_DONE, size, 0);
+    if (!nlh) {
+        nlmsg_free(skb);
+        return -EMSGSIZE;
+    }
+    NETLINK_CB(skb).dst_group = 0;
+    memcpy(nlmsg_data(nlh), data, size);
+
+    return nlmsg_unicast(nl_sk, skb, portid);
+}
+
 void queue_socket_message(uint8_t * msg, uint8_t msg_size)
 {
     int i;
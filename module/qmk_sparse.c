@@ -0,0 +1,187 @@
+/*
+ * Sparse storage for resident keymaps
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/bitmap.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <qmk/keycodes/basic.h>
+
+/*
+ * Only the keymap in use is kept in the padded layout libqmk and the input
+ * core index. Every profile is stored as its base layer in full, and for
+ * each layer above it the keys that differ from that layer's fill value
+ * (whichever of KC_TRNS and KC_NO it holds most), as a bitmap and the
+ * keycodes of the set bits packed in key order. Mostly transparent layers
+ * then cost a bitmap and a few keycodes instead of a padded matrix.
+ */
+
+/**
+ * struct qmk_sparse_keymap - one keymap in sparse form
+ * @layers: layers stored
+ * @keys: rows * cols
+ * @longs: longs in each layer's @defined bitmap
+ * @size: bytes used, for reporting
+ * @fill: per layer, keycode of the keys not in @defined
+ * @start: per layer, index in @packed of its first keycode
+ * @defined: per layer above the base, keys that hold something else
+ *  than the fill value
+ * @packed: keycodes of the defined keys, layer by layer in key order
+ * @base: base layer, row-major
+ */
+struct qmk_sparse_keymap {
+	unsigned int layers;
+	unsigned int keys;
+	unsigned int longs;
+	size_t size;
+	u16 fill[MATRIX_MAX_LAYERS];
+	unsigned int start[MATRIX_MAX_LAYERS];
+	unsigned long *defined;
+	u16 *packed;
+	u16 base[];
+};
+
+static unsigned long *qmk_sparse_defined(const struct qmk_sparse_keymap *sparse,
+					 unsigned int layer)
+{
+	return sparse->defined + (layer - 1) * sparse->longs;
+}
+
+static unsigned int qmk_sparse_index(struct qmk_module *module,
+				     unsigned int layer, unsigned int key)
+{
+	unsigned int cols = module->keyboard->cols;
+
+	return QMK_MATRIX_SCAN_CODE(layer, key / cols, key % cols,
+				    module->layer_shift, module->row_shift);
+}
+
+/**
+ * qmk_sparse_build - store a keymap sparsely
+ * @module: keyboard the keymap belongs to
+ * @keymap: keymap in the padded layout
+ * @layers: number of layers of @keymap to keep
+ *
+ * Returns the sparse keymap, or NULL when out of memory.
+ */
+struct qmk_sparse_keymap *qmk_sparse_build(struct qmk_module *module,
+					   const unsigned short *keymap,
+					   unsigned int layers)
+{
+	struct qmk_keyboard *keyboard = module->keyboard;
+	unsigned int keys = keyboard->rows * keyboard->cols;
+	struct qmk_sparse_keymap *sparse;
+	unsigned int layer, key, trns, none, total = 0;
+	unsigned short code;
+	unsigned long *defined;
+	u16 *packed;
+
+	sparse = kvzalloc(struct_size(sparse, base, keys), GFP_KERNEL);
+	if (!sparse)
+		return NULL;
+
+	sparse->layers = layers;
+	sparse->keys = keys;
+	sparse->longs = BITS_TO_LONGS(keys);
+
+	for (key = 0; key < keys; key++)
+		sparse->base[key] = keymap[qmk_sparse_index(module, 0, key)];
+
+	for (layer = 1; layer < layers; layer++) {
+		trns = none = 0;
+		for (key = 0; key < keys; key++) {
+			code = keymap[qmk_sparse_index(module, layer, key)];
+			trns += code == KC_TRNS;
+			none += code == KC_NO;
+		}
+		sparse->fill[layer] = trns >= none ? KC_TRNS : KC_NO;
+		sparse->start[layer] = total;
+		total += keys - max(trns, none);
+	}
+
+	if (layers > 1) {
+		sparse->defined = kvcalloc((layers - 1) * sparse->longs,
+					   sizeof(unsigned long), GFP_KERNEL);
+		sparse->packed = kvcalloc(total ?: 1, sizeof(u16), GFP_KERNEL);
+		if (!sparse->defined || !sparse->packed) {
+			qmk_sparse_free(sparse);
+			return NULL;
+		}
+	}
+
+	for (layer = 1; layer < layers; layer++) {
+		defined = qmk_sparse_defined(sparse, layer);
+		packed = sparse->packed + sparse->start[layer];
+		for (key = 0; key < keys; key++) {
+			code = keymap[qmk_sparse_index(module, layer, key)];
+			if (code == sparse->fill[layer])
+				continue;
+			__set_bit(key, defined);
+			*packed++ = code;
+		}
+	}
+
+	sparse->size = struct_size(sparse, base, keys) +
+		       (layers - 1) * sparse->longs * sizeof(unsigned long) +
+		       total * sizeof(u16);
+
+	return sparse;
+}
+
+/**
+ * qmk_sparse_expand - write a sparse keymap out in the padded layout
+ * @module: keyboard the keymap belongs to
+ * @sparse: keymap to expand
+ * @keymap: zeroed array of input_dev->keycodemax entries
+ */
+void qmk_sparse_expand(struct qmk_module *module,
+		       const struct qmk_sparse_keymap *sparse,
+		       unsigned short *keymap)
+{
+	const unsigned long *defined;
+	unsigned int layer, key;
+	const u16 *packed;
+
+	for (key = 0; key < sparse->keys; key++)
+		keymap[qmk_sparse_index(module, 0, key)] = sparse->base[key];
+
+	for (layer = 1; layer < sparse->layers; layer++) {
+		defined = qmk_sparse_defined(sparse, layer);
+		packed = sparse->packed + sparse->start[layer];
+		for (key = 0; key < sparse->keys; key++)
+			keymap[qmk_sparse_index(module, layer, key)] =
+				test_bit(key, defined) ? *packed++ :
+							 sparse->fill[layer];
+	}
+}
+
+size_t qmk_sparse_size(const struct qmk_sparse_keymap *sparse)
+{
+	return sparse->size;
+}
+
+void qmk_sparse_free(struct qmk_sparse_keymap *sparse)
+{
+	if (!sparse)
+		return;
+
+	kvfree(sparse->packed);
+	kvfree(sparse->defined);
+	kvfree(sparse);
+}
+
+MODULE_LICENSE("GPL");
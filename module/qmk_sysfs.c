@@ -14,7 +14,12 @@
  */
 
 #include "qmk.h"
+#include "qmk_socket.h"
+#include <linux/bitops.h>
 #include <linux/sysfs.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
 
@@ -23,15 +28,30 @@ static ssize_t qmk_keymap_show(struct device *dev,
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct qmk_module *module = platform_get_drvdata(pdev);
-	struct input_dev *input_dev = module->input_dev;
-	const unsigned short *keymap = input_dev->keycode;
-	int len;
+	struct qmk_keyboard *keyboard = module->keyboard;
+	const unsigned short *keymap;
+	unsigned int layer, row, col, profile;
+	int len = 0;
+	int srcu;
 
-	len = sprintf(buf, "%d\n",
-		      keymap[QMK_MATRIX_SCAN_CODE(0, 0, 7, module->layer_shift,
-						  module->row_shift)]);
-	if (len <= 0)
-		dev_err(dev, "qmk: Invalid sprintf len: %d\n", len);
+	/* every layer as a grid of keycodes, cut off at a page */
+	srcu = srcu_read_lock(&module->keymap_srcu);
+	keymap = qmk_reload_current(module, &profile);
+	for (layer = 0; layer < keyboard->layers; layer++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "layer %u:\n",
+				 layer);
+		for (row = 0; row < keyboard->rows; row++)
+			for (col = 0; col < keyboard->cols; col++)
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "%04x%c",
+						 keymap[QMK_MATRIX_SCAN_CODE(
+							 layer, row, col,
+							 module->layer_shift,
+							 module->row_shift)],
+						 col + 1 < keyboard->cols ?
+							 ' ' : '\n');
+	}
+	srcu_read_unlock(&module->keymap_srcu, srcu);
 
 	return len;
 }
@@ -51,13 +71,8 @@ static ssize_t qmk_layer_state_show(struct device *dev,
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct qmk_module *module = platform_get_drvdata(pdev);
-	int len;
 
-	len = sprintf(buf, "%ld\n", module->layer_state);
-	if (len <= 0)
-		dev_err(dev, "qmk: Invalid sprintf len: %d\n", len);
-
-	return len;
+	return sprintf(buf, "%u\n", READ_ONCE(module->keyboard->layer_state));
 }
 
 static ssize_t qmk_layer_state_store(struct device *dev,
@@ -66,11 +81,28 @@ static ssize_t qmk_layer_state_store(struct device *dev,
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct qmk_module *module = platform_get_drvdata(pdev);
+	struct qmk_keyboard *keyboard = module->keyboard;
+	u32 state;
 	int err;
 
-	err = kstrtoul(buf, 10, &module->layer_state);
+	err = kstrtou32(buf, 0, &state);
 	if (err)
-		dev_err(dev, "qmk: kstrtouint error: %d\n", err);
+		return err;
+
+	if (state & ~GENMASK(keyboard->layers - 1, 0))
+		return -EINVAL;
+
+	mutex_lock(&module->scan_lock);
+	keyboard->layer_state = state;
+	keyboard->active_layer = state ? fls(state) - 1 : 0;
+	queue_socket_message((uint8_t[]){ ACTIVE_LAYER,
+					  keyboard->active_layer }, 2);
+	queue_socket_message((uint8_t[]){ LAYER_STATE, (state >> 24) & 0xFF,
+					  (state >> 16) & 0xFF,
+					  (state >> 8) & 0xFF, state & 0xFF },
+			     5);
+	send_socket_message();
+	mutex_unlock(&module->scan_lock);
 
 	return count;
 }
@@ -78,11 +110,402 @@ static ssize_t qmk_layer_state_store(struct device *dev,
 static DEVICE_ATTR(layer_state, S_IRUGO | S_IWUSR, qmk_layer_state_show,
 		   qmk_layer_state_store);
 
+static ssize_t qmk_scan_stats_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	u64 scans = module->scan_count;
+	u64 events = module->event_count;
+
+	return sprintf(buf,
+		       "scans: %llu\nns_per_scan: %llu\nbus_ns_per_scan: %llu\n"
+		       "events: %llu\nns_per_event: %llu\nghost_scans: %llu\n"
+		       "overruns: %llu\nmax_scan_ns: %llu\n"
+		       "late_ns_per_scan: %llu\nmax_late_ns: %llu\n"
+		       "settle_us: %u\nunhandled_keycodes: %llu\n",
+		       scans, scans ? div64_u64(module->scan_ns, scans) : 0,
+		       scans ? div64_u64(module->bus_ns, scans) : 0, events,
+		       events ? div64_u64(module->event_ns, events) : 0,
+		       module->ghost_count, module->overrun_count,
+		       module->scan_max_ns,
+		       scans ? div64_u64(module->late_ns, scans) : 0,
+		       module->late_max_ns, module->settle_us,
+		       module->unhandled_count);
+}
+
+static ssize_t qmk_scan_stats_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	/* any write resets the counters */
+	module->scan_count = 0;
+	module->scan_ns = 0;
+	module->bus_ns = 0;
+	module->event_count = 0;
+	module->event_ns = 0;
+	module->ghost_count = 0;
+	module->unhandled_count = 0;
+	module->overrun_count = 0;
+	module->scan_max_ns = 0;
+	module->late_ns = 0;
+	module->late_max_ns = 0;
+
+	return count;
+}
+
+static DEVICE_ATTR(scan_stats, S_IRUGO | S_IWUSR, qmk_scan_stats_show,
+		   qmk_scan_stats_store);
+
+static ssize_t qmk_anti_ghost_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%d\n", module->anti_ghost);
+}
+
+static ssize_t qmk_anti_ghost_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	bool enable;
+	int err;
+
+	err = kstrtobool(buf, &enable);
+	if (err)
+		return err;
+
+	mutex_lock(&module->scan_lock);
+	module->anti_ghost = enable;
+	mutex_unlock(&module->scan_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(anti_ghost, S_IRUGO | S_IWUSR, qmk_anti_ghost_show,
+		   qmk_anti_ghost_store);
+
+static ssize_t qmk_scan_thread_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%d\n", module->scan_thread);
+}
+
+/* takes effect the next time the input device is opened */
+static ssize_t qmk_scan_thread_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	bool enable;
+	int err;
+
+	err = kstrtobool(buf, &enable);
+	if (err)
+		return err;
+
+	module->scan_thread = enable;
+
+	return count;
+}
+
+static DEVICE_ATTR(scan_thread, S_IRUGO | S_IWUSR, qmk_scan_thread_show,
+		   qmk_scan_thread_store);
+
+static ssize_t qmk_scan_priority_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u\n", module->scan_priority);
+}
+
+static ssize_t qmk_scan_priority_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	unsigned int priority;
+	int err;
+
+	err = kstrtouint(buf, 10, &priority);
+	if (err)
+		return err;
+
+	err = qmk_thread_set_priority(module, priority);
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR(scan_priority, S_IRUGO | S_IWUSR, qmk_scan_priority_show,
+		   qmk_scan_priority_store);
+
+static ssize_t qmk_scan_cpus_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%*pbl\n", cpumask_pr_args(&module->scan_cpus));
+}
+
+static ssize_t qmk_scan_cpus_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	cpumask_var_t cpus;
+	int err;
+
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	err = cpulist_parse(buf, cpus);
+	if (!err)
+		err = qmk_thread_set_cpus(module, cpus);
+
+	free_cpumask_var(cpus);
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR(scan_cpus, S_IRUGO | S_IWUSR, qmk_scan_cpus_show,
+		   qmk_scan_cpus_store);
+
+static ssize_t qmk_governor_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	struct qmk_governor *governor = &module->governor;
+	u64 now = ktime_get_ns();
+	u64 ns;
+	int i, len;
+
+	mutex_lock(&module->scan_lock);
+
+	len = sprintf(buf, "level: %u\ninterval_ms: %u\n", governor->level,
+		      governor->interval);
+
+	for (i = 0; i < governor->levels; i++) {
+		ns = governor->level_ns[i];
+		if (i == governor->level)
+			ns += now - governor->since;
+
+		len += sprintf(buf + len, "time_at_%ums: %llu\n",
+			       qmk_governor_level_interval(governor, i),
+			       div_u64(ns, NSEC_PER_MSEC));
+	}
+
+	mutex_unlock(&module->scan_lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(governor, S_IRUGO, qmk_governor_show, NULL);
+
+/*
+ * Scan parameters are published to the scan without waiting for it, see
+ * qmk_params.c, and are picked up by the next scan.
+ */
+#define QMK_PARAM_ATTR(_name, _field, _min, _max)                              \
+	static ssize_t qmk_##_name##_show(struct device *dev,                  \
+					  struct device_attribute *attr,       \
+					  char *buf)                           \
+	{                                                                      \
+		struct platform_device *pdev = to_platform_device(dev);        \
+		struct qmk_module *module = platform_get_drvdata(pdev);        \
+		struct qmk_scan_params params;                                 \
+                                                                               \
+		qmk_params_read(module, &params);                              \
+                                                                               \
+		return sprintf(buf, "%u\n", params._field);                    \
+	}                                                                      \
+                                                                               \
+	static ssize_t qmk_##_name##_store(struct device *dev,                 \
+					   struct device_attribute *attr,      \
+					   const char *buf, size_t count)      \
+	{                                                                      \
+		struct platform_device *pdev = to_platform_device(dev);        \
+		struct qmk_module *module = platform_get_drvdata(pdev);        \
+		struct qmk_scan_params *params;                                \
+		unsigned int val;                                              \
+		int err;                                                       \
+                                                                               \
+		err = kstrtouint(buf, 10, &val);                               \
+		if (err)                                                       \
+			return err;                                            \
+		if (val < (_min) || val > (_max))                              \
+			return -EINVAL;                                        \
+                                                                               \
+		params = qmk_params_begin(module);                             \
+		params->_field = val;                                          \
+		qmk_params_commit(module);                                     \
+                                                                               \
+		return count;                                                  \
+	}                                                                      \
+                                                                               \
+	static DEVICE_ATTR(_name, S_IRUGO | S_IWUSR, qmk_##_name##_show,       \
+			   qmk_##_name##_store)
+
+QMK_PARAM_ATTR(poll_interval, poll_interval, QMK_POLL_INTERVAL_MIN, UINT_MAX);
+QMK_PARAM_ATTR(scan_interval_max_ms, scan_interval_max, 0, UINT_MAX);
+QMK_PARAM_ATTR(scan_idle_scans, idle_scans, 1, UINT_MAX);
+QMK_PARAM_ATTR(col_scan_delay_us, col_scan_delay_us, 0,
+	       QMK_COL_SCAN_DELAY_MAX_US);
+QMK_PARAM_ATTR(debounce_delay_ms, debounce_ms, 0, QMK_DEBOUNCE_MAX_MS);
+QMK_PARAM_ATTR(drive_inactive_cols, drive_inactive_cols, 0, 1);
+QMK_PARAM_ATTR(gpio_activelow, active_low, 0, 1);
+
+static ssize_t qmk_strobe_lines_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	if (module->pdata->direct_pins)
+		return sprintf(buf, "none\n");
+
+	return sprintf(buf, "%s\n", module->transposed ? "rows" : "cols");
+}
+
+static DEVICE_ATTR(strobe_lines, S_IRUGO, qmk_strobe_lines_show, NULL);
+
+static ssize_t qmk_profile_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+
+	return sprintf(buf, "%u of %u\n", module->profile,
+		       module->num_profiles);
+}
+
+static ssize_t qmk_profile_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct qmk_module *module = platform_get_drvdata(pdev);
+	unsigned int profile;
+	int err;
+
+	err = kstrtouint(buf, 10, &profile);
+	if (err)
+		return err;
+
+	mutex_lock(&module->scan_lock);
+	err = qmk_profile_select(module, profile);
+	send_socket_message();
+	mutex_unlock(&module->scan_lock);
+
+	return err ?: count;
+}
+
+static DEVICE_ATTR(profile, S_IRUGO | S_IWUSR, qmk_profile_show,
+		   qmk_profile_store);
+
+static ssize_t qmk_key_health_read(struct file *file, struct kobject *kobj,
+				   struct bin_attribute *attr, char *buf,
+				   loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct qmk_module *module = dev_get_drvdata(dev);
+
+	return qmk_health_read(module, buf, off, count);
+}
+
+/* any write clears the counters */
+static ssize_t qmk_key_health_write(struct file *file, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct qmk_module *module = dev_get_drvdata(dev);
+
+	qmk_health_reset(module);
+
+	return count;
+}
+
+static BIN_ATTR(key_health, S_IRUGO | S_IWUSR, qmk_key_health_read,
+		qmk_key_health_write, 0);
+
+static ssize_t qmk_keymap_bin_read(struct file *file, struct kobject *kobj,
+				   struct bin_attribute *attr, char *buf,
+				   loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct qmk_module *module = dev_get_drvdata(dev);
+
+	return qmk_reload_read(module, buf, off, count);
+}
+
+static ssize_t qmk_keymap_bin_write(struct file *file, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct qmk_module *module = dev_get_drvdata(dev);
+
+	return qmk_reload_write(module, buf, off, count);
+}
+
+static BIN_ATTR(keymap_bin, S_IRUGO | S_IWUSR, qmk_keymap_bin_read,
+		qmk_keymap_bin_write, 0);
+
+static ssize_t qmk_keymap_state_read(struct file *file, struct kobject *kobj,
+				     struct bin_attribute *attr, char *buf,
+				     loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct qmk_module *module = dev_get_drvdata(dev);
+
+	return qmk_dump_read(module, buf, off, count);
+}
+
+static BIN_ATTR(keymap_state, S_IRUGO, qmk_keymap_state_read, NULL, 0);
+
+static struct bin_attribute *qmk_bin_attrs[] = { &bin_attr_key_health,
+						 &bin_attr_keymap_bin,
+						 &bin_attr_keymap_state, NULL };
+
 static struct attribute *qmk_attrs[] = { &dev_attr_keymap.attr,
-					 &dev_attr_layer_state.attr, NULL };
+					 &dev_attr_layer_state.attr,
+					 &dev_attr_scan_stats.attr,
+					 &dev_attr_anti_ghost.attr,
+					 &dev_attr_scan_thread.attr,
+					 &dev_attr_scan_priority.attr,
+					 &dev_attr_scan_cpus.attr,
+					 &dev_attr_governor.attr,
+					 &dev_attr_poll_interval.attr,
+					 &dev_attr_scan_interval_max_ms.attr,
+					 &dev_attr_scan_idle_scans.attr,
+					 &dev_attr_col_scan_delay_us.attr,
+					 &dev_attr_debounce_delay_ms.attr,
+					 &dev_attr_drive_inactive_cols.attr,
+					 &dev_attr_gpio_activelow.attr,
+					 &dev_attr_strobe_lines.attr,
+					 &dev_attr_profile.attr,
+					 NULL };
 
 static struct attribute_group qmk_group = {
 	.attrs = qmk_attrs,
+	.bin_attrs = qmk_bin_attrs,
 };
 
 struct attribute_group *get_qmk_group(void)
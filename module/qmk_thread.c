@@ -0,0 +1,147 @@
+/*
+ * Dedicated real-time scan thread
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "qmk.h"
+#include <linux/err.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+
+/*
+ * Scans on absolute deadlines so the period does not drift with the scan
+ * duration. A scan that overruns its slot restarts the schedule instead of
+ * trying to catch up with back-to-back scans.
+ */
+static int qmk_scan_thread(void *data)
+{
+	struct qmk_module *module = data;
+	ktime_t next = ktime_get();
+
+	while (!kthread_should_stop()) {
+		qmk_scan_matrix(module);
+
+		next = ktime_add_ms(next, READ_ONCE(module->governor.interval));
+		if (ktime_before(next, ktime_get()))
+			next = ktime_get();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static int qmk_thread_apply_priority(struct task_struct *task,
+				     unsigned int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
+
+	return sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+}
+
+int qmk_thread_start(struct qmk_module *module)
+{
+	struct task_struct *task;
+	int err;
+
+	mutex_lock(&module->thread_lock);
+
+	if (module->scan_task) {
+		err = 0;
+		goto out;
+	}
+
+	task = kthread_create(qmk_scan_thread, module, "qmk-scan/%s",
+			      dev_name(module->dev));
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		goto out;
+	}
+
+	err = qmk_thread_apply_priority(task, module->scan_priority);
+	if (err)
+		dev_warn(module->dev, "unable to set scan priority, err=%d\n",
+			 err);
+
+	err = set_cpus_allowed_ptr(task, &module->scan_cpus);
+	if (err)
+		dev_warn(module->dev, "unable to set scan affinity, err=%d\n",
+			 err);
+
+	module->scan_task = task;
+	wake_up_process(task);
+	err = 0;
+
+out:
+	mutex_unlock(&module->thread_lock);
+	return err;
+}
+
+void qmk_thread_stop(struct qmk_module *module)
+{
+	mutex_lock(&module->thread_lock);
+
+	if (module->scan_task) {
+		kthread_stop(module->scan_task);
+		module->scan_task = NULL;
+	}
+
+	mutex_unlock(&module->thread_lock);
+}
+
+int qmk_thread_set_priority(struct qmk_module *module, unsigned int priority)
+{
+	int err = 0;
+
+	if (priority < 1 || priority > MAX_USER_RT_PRIO - 1)
+		return -EINVAL;
+
+	mutex_lock(&module->thread_lock);
+
+	if (module->scan_task)
+		err = qmk_thread_apply_priority(module->scan_task, priority);
+	if (!err)
+		module->scan_priority = priority;
+
+	mutex_unlock(&module->thread_lock);
+
+	return err;
+}
+
+int qmk_thread_set_cpus(struct qmk_module *module, const struct cpumask *cpus)
+{
+	int err = 0;
+
+	if (!cpumask_intersects(cpus, cpu_online_mask))
+		return -EINVAL;
+
+	mutex_lock(&module->thread_lock);
+
+	if (module->scan_task)
+		err = set_cpus_allowed_ptr(module->scan_task, cpus);
+	if (!err)
+		cpumask_copy(&module->scan_cpus, cpus);
+
+	mutex_unlock(&module->thread_lock);
+
+	return err;
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,446 @@
+/*
+ * KUnit tests for the keymap helpers
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Keymap properties come from a software node on a platform device no
+ * driver binds to.
+ */
+
+#include <kunit/test.h>
+#include <linux/bitmap.h>
+#include <linux/err.h>
+#include <linux/input.h>
+#include <linux/platform_device.h>
+#include <linux/property.h>
+#include "dt-bindings_input.h"
+#include "qmk.h"
+#include "qmk_scancodes.h"
+#include "qmk_test.h"
+
+/**
+ * struct qmk_keymap_test - what a keymap test builds into
+ * @pdev: device the keymap properties hang off
+ * @input: input device the keymap is built for
+ */
+struct qmk_keymap_test {
+	struct platform_device *pdev;
+	struct input_dev *input;
+};
+
+static struct input_dev *
+qmk_keymap_test_input(struct kunit *test, const struct property_entry *props)
+{
+	struct qmk_keymap_test *ctx = test->priv;
+	struct platform_device_info info = {
+		.name = "qmk-keymap-test",
+		.id = PLATFORM_DEVID_AUTO,
+		.properties = props,
+	};
+
+	ctx->pdev = platform_device_register_full(&info);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(ctx->pdev));
+
+	ctx->input = input_allocate_device();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->input);
+	ctx->input->dev.parent = &ctx->pdev->dev;
+
+	return ctx->input;
+}
+
+static unsigned short *qmk_keymap_test_alloc(struct kunit *test,
+					     unsigned int layers,
+					     unsigned int rows,
+					     unsigned int cols)
+{
+	unsigned int row_shift = get_count_order(cols);
+	unsigned int layer_shift = get_count_order(rows << row_shift);
+	unsigned short *keymap;
+
+	keymap = kunit_kcalloc(test, layers << layer_shift, sizeof(*keymap),
+			       GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, keymap);
+
+	return keymap;
+}
+
+static unsigned short qmk_keymap_test_get(const unsigned short *keymap,
+					  unsigned int layer, unsigned int row,
+					  unsigned int col, unsigned int rows,
+					  unsigned int cols)
+{
+	unsigned int row_shift = get_count_order(cols);
+	unsigned int layer_shift = get_count_order(rows << row_shift);
+
+	return keymap[QMK_MATRIX_SCAN_CODE(layer, row, col, layer_shift,
+					   row_shift)];
+}
+
+/* every field survives packing, and the device tree macro agrees */
+static void qmk_key_encoding_test(struct kunit *test)
+{
+	static const unsigned int lines[] = { 0, 1, 5, 31, 32, 33, 63 };
+	static const unsigned int vals[] = { 0, KC_A, 0x1234, 0xffff };
+	unsigned int layer, r, c, v;
+	u32 key;
+
+	for (layer = 0; layer < MATRIX_KEY_LAYERS; layer++) {
+		for (r = 0; r < ARRAY_SIZE(lines); r++) {
+			for (c = 0; c < ARRAY_SIZE(lines); c++) {
+				for (v = 0; v < ARRAY_SIZE(vals); v++) {
+					key = KEY(layer, lines[r], lines[c],
+						  vals[v]);
+					KUNIT_EXPECT_EQ(test, KEY_LAYER(key),
+							layer);
+					KUNIT_EXPECT_EQ(test, KEY_ROW(key),
+							lines[r]);
+					KUNIT_EXPECT_EQ(test, KEY_COL(key),
+							lines[c]);
+					KUNIT_EXPECT_EQ(test, KEY_VAL(key),
+							vals[v]);
+					KUNIT_EXPECT_EQ(test, key,
+							(u32)LAYER_MATRIX_KEY(
+								layer, lines[r],
+								lines[c],
+								vals[v]));
+				}
+			}
+		}
+	}
+}
+
+/* layers past MATRIX_KEY_LAYERS wrap instead of spilling into the row */
+static void qmk_key_layer_mask_test(struct kunit *test)
+{
+	unsigned int layer;
+	u32 key;
+
+	for (layer = MATRIX_KEY_LAYERS; layer < MATRIX_MAX_LAYERS; layer++) {
+		key = KEY(layer, 63, 63, 0xffff);
+		KUNIT_EXPECT_EQ(test, KEY_LAYER(key),
+				layer - MATRIX_KEY_LAYERS);
+		KUNIT_EXPECT_EQ(test, KEY_ROW(key), 63U);
+		KUNIT_EXPECT_EQ(test, KEY_COL(key), 63U);
+		KUNIT_EXPECT_EQ(test, key,
+				(u32)KEY(layer - MATRIX_KEY_LAYERS, 63, 63,
+					 0xffff));
+	}
+}
+
+/*
+ * Every key of every shape gets a slot of its own inside the table, for
+ * each row_shift and layer_shift the supported matrices give.
+ */
+static void qmk_scan_code_layout_test(struct kunit *test)
+{
+	static const unsigned int sizes[] = { 1, 2, 3, 5, 6, 8, 9, 10,
+					      17, 32, 33, 64 };
+	unsigned int r, c, layer, row, col, rows, cols, index, max_keys;
+	unsigned int row_shift, layer_shift;
+	unsigned long *seen;
+
+	seen = kunit_kcalloc(test,
+			     BITS_TO_LONGS(2 * MATRIX_MAX_ROWS *
+					   MATRIX_MAX_COLS),
+			     sizeof(unsigned long), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, seen);
+
+	for (r = 0; r < ARRAY_SIZE(sizes); r++) {
+		for (c = 0; c < ARRAY_SIZE(sizes); c++) {
+			rows = sizes[r];
+			cols = sizes[c];
+			row_shift = get_count_order(cols);
+			layer_shift = get_count_order(rows << row_shift);
+			max_keys = 2 << layer_shift;
+			KUNIT_ASSERT_LE(test, max_keys,
+					2U * MATRIX_MAX_ROWS * MATRIX_MAX_COLS);
+			bitmap_zero(seen, max_keys);
+
+			for (layer = 0; layer < 2; layer++) {
+				for (row = 0; row < rows; row++) {
+					for (col = 0; col < cols; col++) {
+						index = QMK_MATRIX_SCAN_CODE(
+							layer, row, col,
+							layer_shift,
+							row_shift);
+						KUNIT_ASSERT_LT(test, index,
+								max_keys);
+						KUNIT_EXPECT_FALSE(
+							test,
+							test_and_set_bit(
+								index, seen));
+					}
+				}
+			}
+		}
+	}
+}
+
+static void qmk_map_key_test(struct kunit *test)
+{
+	unsigned int rows = 8, cols = 10, layers = 4;
+	unsigned int row_shift = get_count_order(cols);
+	unsigned int layer_shift = get_count_order(rows << row_shift);
+	struct input_dev *input = qmk_keymap_test_input(test, NULL);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, layers, rows,
+						       cols);
+
+	KUNIT_EXPECT_TRUE(test, qmk_map_key(input, keymap, layers, layer_shift,
+					    rows, cols, row_shift, 0,
+					    KEY(3, 7, 9, KC_B)));
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 3, 7, 9, rows, cols),
+			(unsigned short)KC_B);
+	KUNIT_EXPECT_TRUE(test,
+			  test_bit(keycode_to_scancode[KC_B], input->keybit));
+
+	/* keycodes past the basic range have no Linux key */
+	KUNIT_EXPECT_TRUE(test, qmk_map_key(input, keymap, layers, layer_shift,
+					    rows, cols, row_shift, 0,
+					    KEY(0, 0, 0, QMK_KC_PROFILE)));
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 0, 0, 0, rows, cols),
+			(unsigned short)QMK_KC_PROFILE);
+
+	KUNIT_EXPECT_FALSE(test, qmk_map_key(input, keymap, layers,
+					     layer_shift, rows, cols,
+					     row_shift, 0,
+					     KEY(layers, 0, 0, KC_C)));
+	KUNIT_EXPECT_FALSE(test, qmk_map_key(input, keymap, layers,
+					     layer_shift, rows, cols,
+					     row_shift, 0,
+					     KEY(0, rows, 0, KC_C)));
+	KUNIT_EXPECT_FALSE(test, qmk_map_key(input, keymap, layers,
+					     layer_shift, rows, cols,
+					     row_shift, 0,
+					     KEY(0, 0, cols, KC_C)));
+	KUNIT_EXPECT_FALSE(test,
+			   test_bit(keycode_to_scancode[KC_C], input->keybit));
+}
+
+static void qmk_map_key_layer_base_test(struct kunit *test)
+{
+	unsigned int rows = 2, cols = 3, layers = MATRIX_MAX_LAYERS;
+	unsigned int row_shift = get_count_order(cols);
+	unsigned int layer_shift = get_count_order(rows << row_shift);
+	struct input_dev *input = qmk_keymap_test_input(test, NULL);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, layers, rows,
+						       cols);
+
+	KUNIT_EXPECT_TRUE(test, qmk_map_key(input, keymap, layers, layer_shift,
+					    rows, cols, row_shift,
+					    MATRIX_KEY_LAYERS,
+					    KEY(15, 1, 2, KC_D)));
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 31, 1, 2, rows, cols),
+			(unsigned short)KC_D);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 15, 1, 2, rows, cols),
+			(unsigned short)0);
+
+	KUNIT_EXPECT_FALSE(test, qmk_map_key(input, keymap, 20, layer_shift,
+					     rows, cols, row_shift,
+					     MATRIX_KEY_LAYERS,
+					     KEY(4, 0, 0, KC_D)));
+}
+
+static void qmk_build_keymap_test(struct kunit *test)
+{
+	static const u32 keys[] = {
+		KEY(0, 0, 0, KC_A),
+		KEY(0, 5, 3, KC_Z),
+		KEY(1, 7, 5, KC_TRNS),
+	};
+	static const struct matrix_keymap_data data = {
+		.keymap = keys,
+		.keymap_size = ARRAY_SIZE(keys),
+	};
+	unsigned int rows = 8, cols = 6, layers = 2;
+	struct input_dev *input = qmk_keymap_test_input(test, NULL);
+	const unsigned short *keymap;
+
+	KUNIT_ASSERT_EQ(test, qmk_build_keymap(&data, NULL, layers, rows, cols,
+					       NULL, input),
+			0);
+
+	keymap = input->keycode;
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, keymap);
+	KUNIT_EXPECT_EQ(test, input->keycodemax,
+			2U << get_count_order(rows << get_count_order(cols)));
+	KUNIT_EXPECT_EQ(test, input->keycodesize,
+			(unsigned int)sizeof(*keymap));
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 0, 0, 0, rows, cols),
+			(unsigned short)KC_A);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 0, 5, 3, rows, cols),
+			(unsigned short)KC_Z);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 1, 7, 5, rows, cols),
+			(unsigned short)KC_TRNS);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 1, 0, 0, rows, cols),
+			(unsigned short)KC_NO);
+
+	KUNIT_EXPECT_TRUE(test, test_bit(EV_KEY, input->evbit));
+	KUNIT_EXPECT_TRUE(test,
+			  test_bit(keycode_to_scancode[KC_A], input->keybit));
+	KUNIT_EXPECT_FALSE(test, test_bit(KEY_RESERVED, input->keybit));
+}
+
+static void qmk_build_keymap_invalid_test(struct kunit *test)
+{
+	static const u32 keys[] = {
+		KEY(0, 0, 0, KC_A),
+		KEY(0, 8, 0, KC_B),
+	};
+	static const struct matrix_keymap_data data = {
+		.keymap = keys,
+		.keymap_size = ARRAY_SIZE(keys),
+	};
+	struct input_dev *input = qmk_keymap_test_input(test, NULL);
+
+	KUNIT_EXPECT_EQ(test, qmk_build_keymap(&data, NULL, 1, 8, 6, NULL,
+					       input),
+			-EINVAL);
+}
+
+static void qmk_parse_keymap_test(struct kunit *test)
+{
+	static const u32 keys[] = {
+		KEY(0, 0, 0, KC_ESC),
+		KEY(0, 3, 5, KC_SPC),
+		KEY(2, 3, 5, KC_TRNS),
+	};
+	const struct property_entry props[] = {
+		PROPERTY_ENTRY_U32_ARRAY("qmk,keymap", keys),
+		{}
+	};
+	unsigned int rows = 4, cols = 6, layers = 3;
+	struct input_dev *input = qmk_keymap_test_input(test, props);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, layers, rows,
+						       cols);
+
+	KUNIT_ASSERT_EQ(test, qmk_parse_keymap(NULL, layers, rows, cols, keymap,
+					       input),
+			0);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 0, 0, 0, rows, cols),
+			(unsigned short)KC_ESC);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 0, 3, 5, rows, cols),
+			(unsigned short)KC_SPC);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 2, 3, 5, rows, cols),
+			(unsigned short)KC_TRNS);
+	KUNIT_EXPECT_TRUE(test,
+			  test_bit(keycode_to_scancode[KC_SPC], input->keybit));
+}
+
+static void qmk_parse_keymap_missing_test(struct kunit *test)
+{
+	struct input_dev *input = qmk_keymap_test_input(test, NULL);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, 1, 2, 2);
+
+	KUNIT_EXPECT_LT(test, qmk_parse_keymap(NULL, 1, 2, 2, keymap, input),
+			0);
+}
+
+static void qmk_parse_keymap_overflow_test(struct kunit *test)
+{
+	static const u32 keys[] = {
+		KEY(0, 0, 0, KC_A), KEY(0, 0, 1, KC_B), KEY(0, 1, 0, KC_C),
+		KEY(0, 1, 1, KC_D), KEY(0, 0, 0, KC_E),
+	};
+	const struct property_entry props[] = {
+		PROPERTY_ENTRY_U32_ARRAY("qmk,keymap", keys),
+		{}
+	};
+	struct input_dev *input = qmk_keymap_test_input(test, props);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, 1, 2, 2);
+
+	KUNIT_EXPECT_EQ(test, qmk_parse_keymap(NULL, 1, 2, 2, keymap, input),
+			-EINVAL);
+}
+
+static void qmk_parse_keymap_high_test(struct kunit *test)
+{
+	static const u32 keys[] = { KEY(1, 0, 1, KC_F1) };
+	static const u32 high[] = { KEY(3, 1, 0, KC_F2) };
+	const struct property_entry props[] = {
+		PROPERTY_ENTRY_U32_ARRAY("qmk,profile", keys),
+		PROPERTY_ENTRY_U32_ARRAY("qmk,profile-high", high),
+		{}
+	};
+	unsigned int rows = 2, cols = 2, layers = 20;
+	struct input_dev *input = qmk_keymap_test_input(test, props);
+	unsigned short *keymap = qmk_keymap_test_alloc(test, layers, rows,
+						       cols);
+
+	KUNIT_ASSERT_EQ(test, qmk_parse_keymap("qmk,profile", layers, rows,
+					       cols, keymap, input),
+			0);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 1, 0, 1, rows, cols),
+			(unsigned short)KC_F1);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 19, 1, 0, rows, cols),
+			(unsigned short)KC_F2);
+	KUNIT_EXPECT_EQ(test, qmk_keymap_test_get(keymap, 3, 1, 0, rows, cols),
+			(unsigned short)KC_NO);
+}
+
+static void qmk_parse_keymap_high_layers_test(struct kunit *test)
+{
+	static const u32 keys[] = { KEY(0, 0, 0, KC_A) };
+	const struct property_entry props[] = {
+		PROPERTY_ENTRY_U32_ARRAY("qmk,keymap", keys),
+		PROPERTY_ENTRY_U32_ARRAY("qmk,keymap-high", keys),
+		{}
+	};
+	struct input_dev *input = qmk_keymap_test_input(test, props);
+	unsigned short *keymap =
+		qmk_keymap_test_alloc(test, MATRIX_KEY_LAYERS, 1, 1);
+
+	KUNIT_EXPECT_EQ(test, qmk_parse_keymap(NULL, MATRIX_KEY_LAYERS, 1, 1,
+					       keymap, input),
+			-EINVAL);
+}
+
+static int qmk_keymap_test_init(struct kunit *test)
+{
+	test->priv = kunit_kzalloc(test, sizeof(struct qmk_keymap_test),
+				   GFP_KERNEL);
+
+	return test->priv ? 0 : -ENOMEM;
+}
+
+static void qmk_keymap_test_exit(struct kunit *test)
+{
+	struct qmk_keymap_test *ctx = test->priv;
+
+	input_free_device(ctx->input);
+	if (!IS_ERR_OR_NULL(ctx->pdev))
+		platform_device_unregister(ctx->pdev);
+}
+
+static struct kunit_case qmk_keymap_test_cases[] = {
+	KUNIT_CASE(qmk_key_encoding_test),
+	KUNIT_CASE(qmk_key_layer_mask_test),
+	KUNIT_CASE(qmk_scan_code_layout_test),
+	KUNIT_CASE(qmk_map_key_test),
+	KUNIT_CASE(qmk_map_key_layer_base_test),
+	KUNIT_CASE(qmk_build_keymap_test),
+	KUNIT_CASE(qmk_build_keymap_invalid_test),
+	KUNIT_CASE(qmk_parse_keymap_test),
+	KUNIT_CASE(qmk_parse_keymap_missing_test),
+	KUNIT_CASE(qmk_parse_keymap_overflow_test),
+	KUNIT_CASE(qmk_parse_keymap_high_test),
+	KUNIT_CASE(qmk_parse_keymap_high_layers_test),
+	{}
+};
+
+struct kunit_suite qmk_keymap_test_suite = {
+	.name = "qmk-keymap",
+	.init = qmk_keymap_test_init,
+	.exit = qmk_keymap_test_exit,
+	.test_cases = qmk_keymap_test_cases,
+};
@@ -0,0 +1,331 @@
+/*
+ * KUnit tests and benchmarks for matrix analysis
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Each test sets up a keyboard the way probe does, minus the gpios and the
+ * polled device, and feeds qmk_analyze_state() matrices written straight
+ * into current_key_state. The benchmarks therefore time the analysis and
+ * the event path, not the bus; bus time is reported by the scan_stats
+ * sysfs file on hardware.
+ */
+
+#include <kunit/test.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <qmk/keycodes/basic.h>
+#include "qmk.h"
+#include "qmk_health.h"
+#include "qmk_scancodes.h"
+#include "qmk_test.h"
+
+/* scans and events each benchmark runs */
+#define QMK_BENCH_SCANS 10000
+#define QMK_BENCH_EVENTS 2000
+
+/**
+ * struct qmk_scan_test - keyboard a scan test runs against
+ * @dev: parent of the input device, holds every managed allocation
+ * @pdata: settings probe would have parsed
+ * @keyboard: libqmk state
+ * @module: driver state
+ * @srcu: whether keymap_srcu needs cleaning up
+ */
+struct qmk_scan_test {
+	struct device *dev;
+	struct qmk_platform_data pdata;
+	struct qmk_keyboard keyboard;
+	struct qmk_module module;
+	bool srcu;
+};
+
+static struct qmk_module *qmk_scan_test_board(struct kunit *test,
+					      unsigned int rows,
+					      unsigned int cols,
+					      unsigned int debounce_ms)
+{
+	struct qmk_scan_test *ctx = test->priv;
+	struct qmk_keyboard *keyboard = &ctx->keyboard;
+	struct qmk_module *module = &ctx->module;
+	struct matrix_keymap_data data;
+	struct input_dev *input;
+	unsigned int key, keys = rows * cols;
+	u32 *keymap;
+
+	ctx->dev = root_device_register("qmk-scan-test");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(ctx->dev));
+
+	/* every key on layer 0 types a letter */
+	keymap = kunit_kcalloc(test, keys, sizeof(*keymap), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, keymap);
+	for (key = 0; key < keys; key++)
+		keymap[key] = KEY(0, key / cols, key % cols, KC_A + key % 26);
+	data.keymap = keymap;
+	data.keymap_size = keys;
+
+	input = devm_input_allocate_device(ctx->dev);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, input);
+	input->name = "qmk-scan-test";
+
+	keyboard->layers = 2;
+	keyboard->rows = rows;
+	keyboard->cols = cols;
+	KUNIT_ASSERT_EQ(test, qmk_build_keymap(&data, NULL, keyboard->layers,
+					       rows, cols, NULL, input),
+			0);
+	keyboard->keymap = input->keycode;
+	keyboard->layer_state = 1;
+	keyboard->parent = module;
+
+	ctx->pdata.debounce_ms = debounce_ms;
+	ctx->pdata.stuck_ms = QMK_STUCK_MS_DEFAULT;
+	ctx->pdata.debounce_max_us = QMK_DEBOUNCE_MAX_US_DEFAULT;
+
+	input_set_capability(input, EV_MSC, MSC_SCAN);
+	input_set_drvdata(input, module);
+
+	module->keyboard = keyboard;
+	module->input_dev = input;
+	module->pdata = &ctx->pdata;
+	module->dev = ctx->dev;
+	module->row_shift = get_count_order(cols);
+	module->layer_shift = get_count_order(rows << module->row_shift);
+	module->event_scancode = QMK_SCANCODE_NONE;
+	module->stopped = true;
+	mutex_init(&module->scan_lock);
+	module->debugfs = debugfs_create_dir(dev_name(ctx->dev), NULL);
+
+	KUNIT_ASSERT_EQ(test, init_srcu_struct(&module->keymap_srcu), 0);
+	ctx->srcu = true;
+
+	KUNIT_ASSERT_EQ(test, qmk_alloc_matrix(module), 0);
+	KUNIT_ASSERT_EQ(test, qmk_health_init(module), 0);
+	KUNIT_ASSERT_EQ(test, qmk_effective_init(module), 0);
+	KUNIT_ASSERT_EQ(test, qmk_debounce_init(module), 0);
+	KUNIT_ASSERT_EQ(test, input_register_device(input), 0);
+
+	return module;
+}
+
+static void qmk_scan_test_set(struct qmk_module *module, unsigned int row,
+			      unsigned int col, bool pressed)
+{
+	unsigned int bit = (col << module->col_shift) + row;
+
+	if (pressed)
+		__set_bit(bit, module->current_key_state);
+	else
+		__clear_bit(bit, module->current_key_state);
+}
+
+static bool qmk_scan_test_reported(struct qmk_module *module,
+				   unsigned int row, unsigned int col)
+{
+	return test_bit((col << module->col_shift) + row,
+			module->last_key_state);
+}
+
+static struct qmk_key_health *qmk_scan_test_health(struct qmk_module *module,
+						   unsigned int row,
+						   unsigned int col)
+{
+	return &module->health[row * module->keyboard->cols + col];
+}
+
+static void qmk_analyze_state_idle_test(struct kunit *test)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, 8, 6, 0);
+	u64 now = ktime_get_ns();
+
+	KUNIT_EXPECT_FALSE(test, qmk_analyze_state(module, now));
+	KUNIT_EXPECT_FALSE(test, qmk_analyze_state(module, now + 1));
+	KUNIT_EXPECT_EQ(test, module->event_count, 0ULL);
+}
+
+static void qmk_analyze_state_press_release_test(struct kunit *test)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, 8, 6, 0);
+	struct qmk_key_health *health = qmk_scan_test_health(module, 5, 4);
+	u64 now = ktime_get_ns();
+
+	qmk_scan_test_set(module, 5, 4, true);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now));
+	KUNIT_EXPECT_TRUE(test, qmk_scan_test_reported(module, 5, 4));
+	KUNIT_EXPECT_EQ(test, module->event_count, 1ULL);
+	KUNIT_EXPECT_EQ(test, health->presses, 1U);
+
+	/* a held key is not reported again */
+	KUNIT_EXPECT_FALSE(test, qmk_analyze_state(module, now + 1));
+	KUNIT_EXPECT_EQ(test, module->event_count, 1ULL);
+
+	qmk_scan_test_set(module, 5, 4, false);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now + 2));
+	KUNIT_EXPECT_FALSE(test, qmk_scan_test_reported(module, 5, 4));
+	KUNIT_EXPECT_EQ(test, module->event_count, 2ULL);
+	KUNIT_EXPECT_EQ(test, health->releases, 1U);
+}
+
+/* every key that changed in a scan is reported, on the widest matrix too */
+static void qmk_analyze_state_multiple_test(struct kunit *test)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, 32, 32, 0);
+	u64 now = ktime_get_ns();
+
+	qmk_scan_test_set(module, 0, 0, true);
+	qmk_scan_test_set(module, 31, 0, true);
+	qmk_scan_test_set(module, 0, 31, true);
+	qmk_scan_test_set(module, 31, 31, true);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now));
+	KUNIT_EXPECT_EQ(test, module->event_count, 4ULL);
+	KUNIT_EXPECT_TRUE(test, qmk_scan_test_reported(module, 31, 31));
+
+	qmk_scan_test_set(module, 31, 0, false);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now + 1));
+	KUNIT_EXPECT_EQ(test, module->event_count, 5ULL);
+	KUNIT_EXPECT_TRUE(test, qmk_scan_test_reported(module, 0, 0));
+	KUNIT_EXPECT_FALSE(test, qmk_scan_test_reported(module, 31, 0));
+}
+
+/* a change inside the window is held back as a bounce */
+static void qmk_analyze_state_debounce_test(struct kunit *test)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, 8, 10, 5);
+	/* well clear of the zeroed change times */
+	u64 now = ktime_get_ns() + NSEC_PER_SEC;
+
+	qmk_scan_test_set(module, 2, 9, true);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now));
+
+	qmk_scan_test_set(module, 2, 9, false);
+	KUNIT_EXPECT_FALSE(test,
+			   qmk_analyze_state(module, now + NSEC_PER_MSEC));
+	KUNIT_EXPECT_TRUE(test, qmk_scan_test_reported(module, 2, 9));
+	KUNIT_EXPECT_EQ(test, qmk_scan_test_health(module, 2, 9)->bounces,
+			(u16)1);
+
+	/* the held bounce was put back into the matrix */
+	qmk_scan_test_set(module, 2, 9, false);
+	KUNIT_EXPECT_TRUE(test,
+			  qmk_analyze_state(module, now + 6 * NSEC_PER_MSEC));
+	KUNIT_EXPECT_FALSE(test, qmk_scan_test_reported(module, 2, 9));
+}
+
+/* replayed changes are reported but left out of the key health */
+static void qmk_analyze_state_replay_test(struct kunit *test)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, 8, 6, 0);
+	u64 now = ktime_get_ns();
+
+	module->replay_debounce = qmk_debounce_replay(module);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, module->replay_debounce);
+	module->replaying = true;
+
+	qmk_scan_test_set(module, 1, 1, true);
+	KUNIT_EXPECT_TRUE(test, qmk_analyze_state(module, now));
+	KUNIT_EXPECT_EQ(test, module->event_count, 1ULL);
+	KUNIT_EXPECT_EQ(test, qmk_scan_test_health(module, 1, 1)->presses, 0U);
+
+	module->replaying = false;
+	qmk_debounce_free(module->replay_debounce);
+	module->replay_debounce = NULL;
+}
+
+/*
+ * ns per scan is an analysis that finds nothing changed, ns per event is
+ * what the driver itself accounts to each reported change.
+ */
+static void qmk_scan_bench(struct kunit *test, unsigned int rows,
+			   unsigned int cols)
+{
+	struct qmk_module *module = qmk_scan_test_board(test, rows, cols, 0);
+	unsigned int i, key, keys = rows * cols;
+	u64 now = ktime_get_ns();
+	u64 start, scan_ns;
+
+	start = ktime_get_ns();
+	for (i = 0; i < QMK_BENCH_SCANS; i++)
+		qmk_analyze_state(module, now + i);
+	scan_ns = ktime_get_ns() - start;
+
+	/* each key pressed and released in turn */
+	for (i = 0; i < QMK_BENCH_EVENTS; i++) {
+		key = (i / 2) % keys;
+		qmk_scan_test_set(module, key / cols, key % cols, !(i & 1));
+		qmk_analyze_state(module, now + QMK_BENCH_SCANS + i);
+	}
+
+	KUNIT_EXPECT_EQ(test, module->event_count, (u64)QMK_BENCH_EVENTS);
+	kunit_info(test, "%ux%u: %llu ns per scan, %llu ns per event\n", rows,
+		   cols, div_u64(scan_ns, QMK_BENCH_SCANS),
+		   div64_u64(module->event_ns, module->event_count));
+}
+
+static void qmk_scan_bench_8x6(struct kunit *test)
+{
+	qmk_scan_bench(test, 8, 6);
+}
+
+static void qmk_scan_bench_8x10(struct kunit *test)
+{
+	qmk_scan_bench(test, 8, 10);
+}
+
+static void qmk_scan_bench_32x32(struct kunit *test)
+{
+	qmk_scan_bench(test, 32, 32);
+}
+
+static int qmk_scan_test_init(struct kunit *test)
+{
+	test->priv = kunit_kzalloc(test, sizeof(struct qmk_scan_test),
+				   GFP_KERNEL);
+
+	return test->priv ? 0 : -ENOMEM;
+}
+
+static void qmk_scan_test_exit(struct kunit *test)
+{
+	struct qmk_scan_test *ctx = test->priv;
+
+	/* releases the input device and every managed allocation */
+	if (!IS_ERR_OR_NULL(ctx->dev))
+		root_device_unregister(ctx->dev);
+	debugfs_remove_recursive(ctx->module.debugfs);
+	if (ctx->srcu)
+		cleanup_srcu_struct(&ctx->module.keymap_srcu);
+}
+
+static struct kunit_case qmk_scan_test_cases[] = {
+	KUNIT_CASE(qmk_analyze_state_idle_test),
+	KUNIT_CASE(qmk_analyze_state_press_release_test),
+	KUNIT_CASE(qmk_analyze_state_multiple_test),
+	KUNIT_CASE(qmk_analyze_state_debounce_test),
+	KUNIT_CASE(qmk_analyze_state_replay_test),
+	KUNIT_CASE(qmk_scan_bench_8x6),
+	KUNIT_CASE(qmk_scan_bench_8x10),
+	KUNIT_CASE(qmk_scan_bench_32x32),
+	{}
+};
+
+struct kunit_suite qmk_scan_test_suite = {
+	.name = "qmk-scan",
+	.init = qmk_scan_test_init,
+	.exit = qmk_scan_test_exit,
+	.test_cases = qmk_scan_test_cases,
+};
@@ -0,0 +1,31 @@
+/*
+ * KUnit suites for the QMK driver
+ *
+ * Copyright (C) 2019 Jack Humbert <jack.humb@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The suites live in a module of their own, qmk_test.ko, so qmk.ko keeps
+ * its own module_init and never runs them. In a module, kunit_test_suites()
+ * is itself a module_init on every kernel input-polldev is still in, so it
+ * may only appear once, here.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include "qmk_test.h"
+
+kunit_test_suites(&qmk_keymap_test_suite, &qmk_scan_test_suite);
+
+MODULE_AUTHOR("Jack Humbert <jack.humb@gmail.com>");
+MODULE_DESCRIPTION("KUnit tests for the QMK driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _QMK_TEST_H
+#define _QMK_TEST_H
+
+#include <kunit/test.h>
+
+extern struct kunit_suite qmk_keymap_test_suite;
+extern struct kunit_suite qmk_scan_test_suite;
+
+#endif /* _QMK_TEST_H */